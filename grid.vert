@@ -1,15 +1,19 @@
 #version 300 es
-in vec3 position;
-in vec3 color;
-in vec3 normal;
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 color;
+layout(location = 2) in vec3 normal;
 
 out vec4 vPosition;
 out vec3 vColor;
 out vec3 vNormal;
 
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout(std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    mat4 overlayProjection;
+};
 		
 void main() {
     vec4 pos = vec4(position.xyz, 1.0);
@@ -18,5 +22,5 @@ void main() {
     vNormal = normal;
     vPosition = pos;
     
-    gl_Position = pos * (model * view * projection);
+    gl_Position = pos * (model * viewProjection);
 }    
\ No newline at end of file
@@ -0,0 +1,11 @@
+#version 300 es
+precision highp float;
+
+in vec3 vColor;
+
+out vec4 outColor;
+
+// The object ID is packed into the color, so it must come out unshaded
+void main() {
+    outColor = vec4(vColor.xyz, 1.0);
+}
@@ -0,0 +1,23 @@
+#version 300 es
+layout(location = 0) in vec3 position;
+
+// Per-object transform, with the object's ID packed into the color
+layout(location = 3) in vec3 instancePosition;
+layout(location = 4) in vec3 instanceScaling;
+layout(location = 5) in vec3 instanceColor;
+
+out vec3 vColor;
+
+layout(std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    mat4 overlayProjection;
+};
+
+void main() {
+    vColor = instanceColor;
+    
+    vec3 worldPosition = position * instanceScaling + instancePosition;
+    gl_Position = vec4(worldPosition, 1.0) * viewProjection;
+}
@@ -6,6 +6,15 @@
 #include <vector>
 #include <array>
 #include <map>
+#include <unordered_map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <functional>
+
+#include <sys/stat.h>
 
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -13,10 +22,22 @@
 
 //#include <GLES2/gl2.h>
 #include <GLES3/gl3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #include <ft2build.h>
 #include FT_FREETYPE_H
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// AVX2 kernels are compiled per function and only used when the processor reports support
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PACKET_AVX2
+#include <immintrin.h>
+#endif
+
 const int SCREEN_WIDTH = 640;
 const int SCREEN_HEIGHT = 480;
 SDL_Window *windows;
@@ -304,6 +325,758 @@ struct AABB {
                 (point.y >= min.y && point.y <= max.y) && 
                 (point.z >= min.z && point.z <= max.z);
     }
+    
+    // Slab test: clips the ray [0, maxLength] against the three pairs of axis-aligned planes.
+    // On a hit, 'distance' holds the entry point along the ray (0 if the origin is inside).
+    bool intersect_ray(const Vec3f &origin, const Vec3f &direction, float maxLength, float &distance) {
+         const float start[3] = { origin.x, origin.y, origin.z };
+         const float dir[3] = { direction.x, direction.y, direction.z };
+         const float low[3] = { min.x, min.y, min.z };
+         const float high[3] = { max.x, max.y, max.z };
+         
+         float tNear = 0.0f, tFar = maxLength;
+         for (int axis = 0; axis < 3; axis++) {
+              if (fabs(dir[axis]) < 1e-8f) {
+                   // Parallel to this slab, so the origin has to be between the planes
+                   if (start[axis] < low[axis] || start[axis] > high[axis]) return false;
+                   continue;
+              }
+              float inverse = 1.0f / dir[axis];
+              float t1 = (low[axis] - start[axis]) * inverse;
+              float t2 = (high[axis] - start[axis]) * inverse;
+              if (t1 > t2) std::swap(t1, t2);
+              
+              if (t1 > tNear) tNear = t1;
+              if (t2 < tFar) tFar = t2;
+              if (tNear > tFar) return false;
+         }
+         distance = tNear;
+         return true;
+    }
+    
+    bool overlaps(const AABB &other) const {
+         return (min.x <= other.max.x && max.x >= other.min.x) &&
+                (min.y <= other.max.y && max.y >= other.min.y) &&
+                (min.z <= other.max.z && max.z >= other.min.z);
+    }
+    void merge(const AABB &other) {
+         min = Vec3f(std::min(min.x, other.min.x), std::min(min.y, other.min.y), std::min(min.z, other.min.z));
+         max = Vec3f(std::max(max.x, other.max.x), std::max(max.y, other.max.y), std::max(max.z, other.max.z));
+    }
+    void merge(const Vec3f &point) {
+         merge(AABB(point, point));
+    }
+    Vec3f center() const {
+         return Vec3f((min.x + max.x) * 0.5f, (min.y + max.y) * 0.5f, (min.z + max.z) * 0.5f);
+    }
+    float surface_area() const {
+         float dx = max.x - min.x, dy = max.y - min.y, dz = max.z - min.z;
+         return 2.0f * (dx * dy + dy * dz + dz * dx);
+    }
+};
+
+// Six clipping planes (a, b, c, d), where a * x + b * y + c * z + d >= 0 is inside
+struct Frustum {
+    float planes[6][4];
+    Frustum() {}
+    Frustum(const Mat4x4 &combined) {
+         set(combined);
+    }
+    Frustum(const Mat4x4 &combined, float left, float bottom, float right, float top) {
+         set(combined, left, bottom, right, top);
+    }
+    
+    // Extracts the planes from a view-projection matrix (Gribb & Hartmann).
+    // The matrix maps column vectors, so row i lives in values[i * 4 .. i * 4 + 3].
+    // The side planes can be narrowed to a rectangle given in normalized device coordinates.
+    void set(const Mat4x4 &combined, float left = -1.0f, float bottom = -1.0f, float right = 1.0f, float top = 1.0f) {
+         const float *m = combined.values;
+         for (int j = 0; j < 4; j++) {
+              planes[0][j] = m[0 + j] - left * m[12 + j];
+              planes[1][j] = right * m[12 + j] - m[0 + j];
+              planes[2][j] = m[4 + j] - bottom * m[12 + j];
+              planes[3][j] = top * m[12 + j] - m[4 + j];
+              planes[4][j] = m[12 + j] + m[8 + j];
+              planes[5][j] = m[12 + j] - m[8 + j];
+         }
+    }
+    
+    // 0 - outside, 1 - intersecting, 2 - fully inside
+    int classify(const AABB &box) const {
+         int result = 2;
+         for (int i = 0; i < 6; i++) {
+              const float *p = planes[i];
+              
+              // The corner furthest along the plane normal, and the one opposite to it
+              float px = p[0] >= 0 ? box.max.x : box.min.x;
+              float py = p[1] >= 0 ? box.max.y : box.min.y;
+              float pz = p[2] >= 0 ? box.max.z : box.min.z;
+              if (p[0] * px + p[1] * py + p[2] * pz + p[3] < 0) return 0;
+              
+              float nx = p[0] >= 0 ? box.min.x : box.max.x;
+              float ny = p[1] >= 0 ? box.min.y : box.max.y;
+              float nz = p[2] >= 0 ? box.min.z : box.max.z;
+              if (p[0] * nx + p[1] * ny + p[2] * nz + p[3] < 0) result = 1;
+         }
+         return result;
+    }
+    bool intersects(const AABB &box) const {
+         return classify(box) != 0;
+    }
+};
+
+// Up to 16 rays stored as separate coordinate arrays, so the packet kernels can test 4 or 8 of them
+// with one instruction. Lanes past 'size' keep a negative length and never report a hit.
+struct RayPacket {
+    static const int maxSize = 16;
+    int size = 0;
+    alignas(32) float originX[maxSize], originY[maxSize], originZ[maxSize];
+    alignas(32) float directionX[maxSize], directionY[maxSize], directionZ[maxSize];
+    alignas(32) float inverseX[maxSize], inverseY[maxSize], inverseZ[maxSize];
+    
+    // Shortened to the nearest hit found so far
+    alignas(32) float maxLength[maxSize];
+    
+    // Primitive of the nearest hit (or -1), with its barycentric coordinates when it is a triangle
+    alignas(32) float u[maxSize], v[maxSize];
+    int hit[maxSize];
+    
+    RayPacket() {
+         clear();
+    }
+    
+    void clear() {
+         size = 0;
+         for (int i = 0; i < maxSize; i++) {
+              set(i, Vec3f(0.0f, 0.0f, 0.0f), Vec3f(1.0f, 0.0f, 0.0f), -1.0f);
+         }
+    }
+    bool add(const Vec3f &origin, const Vec3f &direction, float length) {
+         if (size == maxSize) return false;
+         set(size++, origin, direction, length);
+         return true;
+    }
+    void set(int lane, const Vec3f &origin, const Vec3f &direction, float length) {
+         originX[lane] = origin.x;
+         originY[lane] = origin.y;
+         originZ[lane] = origin.z;
+         directionX[lane] = direction.x;
+         directionY[lane] = direction.y;
+         directionZ[lane] = direction.z;
+         inverseX[lane] = inverse_of(direction.x);
+         inverseY[lane] = inverse_of(direction.y);
+         inverseZ[lane] = inverse_of(direction.z);
+         maxLength[lane] = length;
+         u[lane] = v[lane] = 0.0f;
+         hit[lane] = -1;
+    }
+    
+    Vec3f get_origin(int lane) const { return Vec3f(originX[lane], originY[lane], originZ[lane]); }
+    Vec3f get_direction(int lane) const { return Vec3f(directionX[lane], directionY[lane], directionZ[lane]); }
+    
+    private:
+       // Near-zero components are nudged away from zero, so the slab test never multiplies 0 by infinity
+       static float inverse_of(float value) {
+            if (fabs(value) < 1e-8f) value = value < 0.0f ? -1e-8f : 1e-8f;
+            return 1.0f / value;
+       }
+};
+
+// Ray packet tests against boxes and triangles. Each one has a scalar, an SSE (4 rays) and an AVX2
+// (8 rays) version; select() points the shared entry points at the widest one the processor supports.
+// Results are bit masks with bit i standing for ray i.
+namespace PacketKernels {
+     // Rays entering the box within [0, maxLength]. 'entry' receives the entry distances and must be
+     // aligned like the packet's arrays.
+     typedef int (*BoxTest)(const RayPacket &packet, const AABB &box, float *entry);
+     
+     // Rays hitting the triangle nearer than their current length, which get the hit recorded
+     typedef int (*TriangleTest)(RayPacket &packet, const Vec3f &a, const Vec3f &b, const Vec3f &c, int triangle);
+     
+     int box_scalar(const RayPacket &packet, const AABB &box, float *entry) {
+          int mask = 0;
+          for (int i = 0; i < packet.size; i++) {
+               float t1 = (box.min.x - packet.originX[i]) * packet.inverseX[i];
+               float t2 = (box.max.x - packet.originX[i]) * packet.inverseX[i];
+               float tNear = std::max(0.0f, std::min(t1, t2));
+               float tFar = std::min(packet.maxLength[i], std::max(t1, t2));
+               
+               t1 = (box.min.y - packet.originY[i]) * packet.inverseY[i];
+               t2 = (box.max.y - packet.originY[i]) * packet.inverseY[i];
+               tNear = std::max(tNear, std::min(t1, t2));
+               tFar = std::min(tFar, std::max(t1, t2));
+               
+               t1 = (box.min.z - packet.originZ[i]) * packet.inverseZ[i];
+               t2 = (box.max.z - packet.originZ[i]) * packet.inverseZ[i];
+               tNear = std::max(tNear, std::min(t1, t2));
+               tFar = std::min(tFar, std::max(t1, t2));
+               
+               entry[i] = tNear;
+               if (tNear <= tFar) mask |= 1 << i;
+          }
+          return mask;
+     }
+     
+     // Same Möller-Trumbore test as Mesh::intersect_triangle, one ray at a time
+     int triangle_scalar(RayPacket &packet, const Vec3f &a, const Vec3f &b, const Vec3f &c, int triangle) {
+          float e1x = b.x - a.x, e1y = b.y - a.y, e1z = b.z - a.z;
+          float e2x = c.x - a.x, e2y = c.y - a.y, e2z = c.z - a.z;
+          
+          int mask = 0;
+          for (int i = 0; i < packet.size; i++) {
+               float dx = packet.directionX[i], dy = packet.directionY[i], dz = packet.directionZ[i];
+               float px = dy * e2z - dz * e2y;
+               float py = dz * e2x - dx * e2z;
+               float pz = dx * e2y - dy * e2x;
+               float determinant = e1x * px + e1y * py + e1z * pz;
+               if (fabs(determinant) < 1e-12f) continue;
+               float inverse = 1.0f / determinant;
+               
+               float tx = packet.originX[i] - a.x, ty = packet.originY[i] - a.y, tz = packet.originZ[i] - a.z;
+               float u = (tx * px + ty * py + tz * pz) * inverse;
+               if (u < 0.0f || u > 1.0f) continue;
+               
+               float qx = ty * e1z - tz * e1y;
+               float qy = tz * e1x - tx * e1z;
+               float qz = tx * e1y - ty * e1x;
+               float v = (dx * qx + dy * qy + dz * qz) * inverse;
+               if (v < 0.0f || u + v > 1.0f) continue;
+               
+               float distance = (e2x * qx + e2y * qy + e2z * qz) * inverse;
+               if (distance < 0.0f || distance >= packet.maxLength[i]) continue;
+               
+               packet.maxLength[i] = distance;
+               packet.u[i] = u;
+               packet.v[i] = v;
+               packet.hit[i] = triangle;
+               mask |= 1 << i;
+          }
+          return mask;
+     }
+     
+#if defined(__SSE2__)
+     int box_sse(const RayPacket &packet, const AABB &box, float *entry) {
+          const __m128 zero = _mm_setzero_ps();
+          const __m128 minX = _mm_set1_ps(box.min.x), minY = _mm_set1_ps(box.min.y), minZ = _mm_set1_ps(box.min.z);
+          const __m128 maxX = _mm_set1_ps(box.max.x), maxY = _mm_set1_ps(box.max.y), maxZ = _mm_set1_ps(box.max.z);
+          
+          int mask = 0;
+          for (int i = 0; i < packet.size; i += 4) {
+               __m128 origin = _mm_load_ps(packet.originX + i), inverse = _mm_load_ps(packet.inverseX + i);
+               __m128 t1 = _mm_mul_ps(_mm_sub_ps(minX, origin), inverse);
+               __m128 t2 = _mm_mul_ps(_mm_sub_ps(maxX, origin), inverse);
+               __m128 tNear = _mm_max_ps(zero, _mm_min_ps(t1, t2));
+               __m128 tFar = _mm_min_ps(_mm_load_ps(packet.maxLength + i), _mm_max_ps(t1, t2));
+               
+               origin = _mm_load_ps(packet.originY + i), inverse = _mm_load_ps(packet.inverseY + i);
+               t1 = _mm_mul_ps(_mm_sub_ps(minY, origin), inverse);
+               t2 = _mm_mul_ps(_mm_sub_ps(maxY, origin), inverse);
+               tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+               tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+               
+               origin = _mm_load_ps(packet.originZ + i), inverse = _mm_load_ps(packet.inverseZ + i);
+               t1 = _mm_mul_ps(_mm_sub_ps(minZ, origin), inverse);
+               t2 = _mm_mul_ps(_mm_sub_ps(maxZ, origin), inverse);
+               tNear = _mm_max_ps(tNear, _mm_min_ps(t1, t2));
+               tFar = _mm_min_ps(tFar, _mm_max_ps(t1, t2));
+               
+               _mm_store_ps(entry + i, tNear);
+               mask |= _mm_movemask_ps(_mm_cmple_ps(tNear, tFar)) << i;
+          }
+          return mask;
+     }
+     
+     int triangle_sse(RayPacket &packet, const Vec3f &a, const Vec3f &b, const Vec3f &c, int triangle) {
+          const __m128 e1x = _mm_set1_ps(b.x - a.x), e1y = _mm_set1_ps(b.y - a.y), e1z = _mm_set1_ps(b.z - a.z);
+          const __m128 e2x = _mm_set1_ps(c.x - a.x), e2y = _mm_set1_ps(c.y - a.y), e2z = _mm_set1_ps(c.z - a.z);
+          const __m128 ax = _mm_set1_ps(a.x), ay = _mm_set1_ps(a.y), az = _mm_set1_ps(a.z);
+          const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), epsilon = _mm_set1_ps(1e-12f);
+          const __m128 sign = _mm_set1_ps(-0.0f);
+          
+          int mask = 0;
+          for (int i = 0; i < packet.size; i += 4) {
+               __m128 dx = _mm_load_ps(packet.directionX + i), dy = _mm_load_ps(packet.directionY + i), dz = _mm_load_ps(packet.directionZ + i);
+               __m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+               __m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+               __m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+               __m128 determinant = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+               __m128 inverse = _mm_div_ps(one, determinant);
+               
+               __m128 tx = _mm_sub_ps(_mm_load_ps(packet.originX + i), ax);
+               __m128 ty = _mm_sub_ps(_mm_load_ps(packet.originY + i), ay);
+               __m128 tz = _mm_sub_ps(_mm_load_ps(packet.originZ + i), az);
+               __m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(tx, px), _mm_mul_ps(ty, py)), _mm_mul_ps(tz, pz)), inverse);
+               
+               __m128 qx = _mm_sub_ps(_mm_mul_ps(ty, e1z), _mm_mul_ps(tz, e1y));
+               __m128 qy = _mm_sub_ps(_mm_mul_ps(tz, e1x), _mm_mul_ps(tx, e1z));
+               __m128 qz = _mm_sub_ps(_mm_mul_ps(tx, e1y), _mm_mul_ps(ty, e1x));
+               __m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), inverse);
+               __m128 distance = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), inverse);
+               
+               // Comparisons against NaN fail, which also rejects the degenerate lanes divided by zero
+               __m128 length = _mm_load_ps(packet.maxLength + i);
+               __m128 accepted = _mm_cmpge_ps(_mm_andnot_ps(sign, determinant), epsilon);
+               accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+               accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+               accepted = _mm_and_ps(accepted, _mm_and_ps(_mm_cmpge_ps(distance, zero), _mm_cmplt_ps(distance, length)));
+               
+               int lanes = _mm_movemask_ps(accepted);
+               if (lanes == 0) continue;
+               
+               _mm_store_ps(packet.maxLength + i, _mm_or_ps(_mm_and_ps(accepted, distance), _mm_andnot_ps(accepted, length)));
+               _mm_store_ps(packet.u + i, _mm_or_ps(_mm_and_ps(accepted, u), _mm_andnot_ps(accepted, _mm_load_ps(packet.u + i))));
+               _mm_store_ps(packet.v + i, _mm_or_ps(_mm_and_ps(accepted, v), _mm_andnot_ps(accepted, _mm_load_ps(packet.v + i))));
+               for (int lane = 0; lane < 4; lane++) {
+                    if (lanes & (1 << lane)) packet.hit[i + lane] = triangle;
+               }
+               mask |= lanes << i;
+          }
+          return mask;
+     }
+#endif
+
+#if defined(PACKET_AVX2)
+     __attribute__((target("avx2"))) int box_avx2(const RayPacket &packet, const AABB &box, float *entry) {
+          const __m256 zero = _mm256_setzero_ps();
+          const __m256 minX = _mm256_set1_ps(box.min.x), minY = _mm256_set1_ps(box.min.y), minZ = _mm256_set1_ps(box.min.z);
+          const __m256 maxX = _mm256_set1_ps(box.max.x), maxY = _mm256_set1_ps(box.max.y), maxZ = _mm256_set1_ps(box.max.z);
+          
+          int mask = 0;
+          for (int i = 0; i < packet.size; i += 8) {
+               __m256 origin = _mm256_load_ps(packet.originX + i), inverse = _mm256_load_ps(packet.inverseX + i);
+               __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(minX, origin), inverse);
+               __m256 t2 = _mm256_mul_ps(_mm256_sub_ps(maxX, origin), inverse);
+               __m256 tNear = _mm256_max_ps(zero, _mm256_min_ps(t1, t2));
+               __m256 tFar = _mm256_min_ps(_mm256_load_ps(packet.maxLength + i), _mm256_max_ps(t1, t2));
+               
+               origin = _mm256_load_ps(packet.originY + i), inverse = _mm256_load_ps(packet.inverseY + i);
+               t1 = _mm256_mul_ps(_mm256_sub_ps(minY, origin), inverse);
+               t2 = _mm256_mul_ps(_mm256_sub_ps(maxY, origin), inverse);
+               tNear = _mm256_max_ps(tNear, _mm256_min_ps(t1, t2));
+               tFar = _mm256_min_ps(tFar, _mm256_max_ps(t1, t2));
+               
+               origin = _mm256_load_ps(packet.originZ + i), inverse = _mm256_load_ps(packet.inverseZ + i);
+               t1 = _mm256_mul_ps(_mm256_sub_ps(minZ, origin), inverse);
+               t2 = _mm256_mul_ps(_mm256_sub_ps(maxZ, origin), inverse);
+               tNear = _mm256_max_ps(tNear, _mm256_min_ps(t1, t2));
+               tFar = _mm256_min_ps(tFar, _mm256_max_ps(t1, t2));
+               
+               _mm256_store_ps(entry + i, tNear);
+               mask |= _mm256_movemask_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ)) << i;
+          }
+          return mask;
+     }
+     
+     __attribute__((target("avx2"))) int triangle_avx2(RayPacket &packet, const Vec3f &a, const Vec3f &b, const Vec3f &c, int triangle) {
+          const __m256 e1x = _mm256_set1_ps(b.x - a.x), e1y = _mm256_set1_ps(b.y - a.y), e1z = _mm256_set1_ps(b.z - a.z);
+          const __m256 e2x = _mm256_set1_ps(c.x - a.x), e2y = _mm256_set1_ps(c.y - a.y), e2z = _mm256_set1_ps(c.z - a.z);
+          const __m256 ax = _mm256_set1_ps(a.x), ay = _mm256_set1_ps(a.y), az = _mm256_set1_ps(a.z);
+          const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), epsilon = _mm256_set1_ps(1e-12f);
+          const __m256 sign = _mm256_set1_ps(-0.0f);
+          
+          int mask = 0;
+          for (int i = 0; i < packet.size; i += 8) {
+               __m256 dx = _mm256_load_ps(packet.directionX + i), dy = _mm256_load_ps(packet.directionY + i), dz = _mm256_load_ps(packet.directionZ + i);
+               __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+               __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+               __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+               __m256 determinant = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+               __m256 inverse = _mm256_div_ps(one, determinant);
+               
+               __m256 tx = _mm256_sub_ps(_mm256_load_ps(packet.originX + i), ax);
+               __m256 ty = _mm256_sub_ps(_mm256_load_ps(packet.originY + i), ay);
+               __m256 tz = _mm256_sub_ps(_mm256_load_ps(packet.originZ + i), az);
+               __m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), inverse);
+               
+               __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+               __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+               __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+               __m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), inverse);
+               __m256 distance = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), inverse);
+               
+               __m256 length = _mm256_load_ps(packet.maxLength + i);
+               __m256 accepted = _mm256_cmp_ps(_mm256_andnot_ps(sign, determinant), epsilon, _CMP_GE_OQ);
+               accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+               accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+               accepted = _mm256_and_ps(accepted, _mm256_and_ps(_mm256_cmp_ps(distance, zero, _CMP_GE_OQ), _mm256_cmp_ps(distance, length, _CMP_LT_OQ)));
+               
+               int lanes = _mm256_movemask_ps(accepted);
+               if (lanes == 0) continue;
+               
+               _mm256_store_ps(packet.maxLength + i, _mm256_blendv_ps(length, distance, accepted));
+               _mm256_store_ps(packet.u + i, _mm256_blendv_ps(_mm256_load_ps(packet.u + i), u, accepted));
+               _mm256_store_ps(packet.v + i, _mm256_blendv_ps(_mm256_load_ps(packet.v + i), v, accepted));
+               for (int lane = 0; lane < 8; lane++) {
+                    if (lanes & (1 << lane)) packet.hit[i + lane] = triangle;
+               }
+               mask |= lanes << i;
+          }
+          return mask;
+     }
+#endif
+     
+     BoxTest intersect_box = box_scalar;
+     TriangleTest intersect_triangle = triangle_scalar;
+     const char *name = "scalar";
+     
+     void use_scalar() {
+          intersect_box = box_scalar;
+          intersect_triangle = triangle_scalar;
+          name = "scalar";
+     }
+     bool use_sse() {
+#if defined(__SSE2__)
+          if (SDL_HasSSE2()) {
+               intersect_box = box_sse;
+               intersect_triangle = triangle_sse;
+               name = "SSE2";
+               return true;
+          }
+#endif
+          return false;
+     }
+     bool use_avx2() {
+#if defined(PACKET_AVX2)
+          if (SDL_HasAVX2()) {
+               intersect_box = box_avx2;
+               intersect_triangle = triangle_avx2;
+               name = "AVX2";
+               return true;
+          }
+#endif
+          return false;
+     }
+     
+     // Widest kernels that were compiled in and that the processor supports
+     void select() {
+          if (use_avx2()) return;
+          if (use_sse()) return;
+          use_scalar();
+     }
+     
+     // Smallest entry distance among the rays in 'mask'
+     float nearest(const float *entry, int mask) {
+          float result = INFINITY;
+          for (int i = 0; mask != 0; i++, mask >>= 1) {
+               if (mask & 1) result = std::min(result, entry[i]);
+          }
+          return result;
+     }
+};
+
+struct BVHNode {
+    AABB bounds;
+    int left = -1, right = -1;
+    int parent = -1;
+    
+    // Range inside the primitive list, used by leaves
+    int first = 0, count = 0;
+    
+    bool is_leaf() const { return left == -1; }
+};
+
+// Bounding volume hierarchy over a list of primitive bounds, built with a binned surface area heuristic.
+// Primitives are referred to by their index in the list given to build().
+class BVH {
+    public:
+        static const int maxLeafSize = 4;
+        static const int maxDepth = 64;
+        static const int binCount = 12;
+        
+        void build(const std::vector<AABB> &bounds) {
+             primitiveBounds = bounds;
+             nodes.clear();
+             primitives.resize(bounds.size());
+             leaves.assign(bounds.size(), -1);
+             centroids.resize(bounds.size());
+             for (int i = 0; i < bounds.size(); i++) {
+                  primitives[i] = i;
+                  centroids[i] = bounds[i].center();
+             }
+             if (bounds.empty()) return;
+             
+             nodes.reserve(bounds.size() * 2);
+             build_node(-1, 0, bounds.size(), 0);
+        }
+        
+        // Updates one primitive's bounds and refits the nodes above it, without changing the topology
+        void refit(int primitive, const AABB &bounds) {
+             if (primitive < 0 || primitive >= leaves.size()) return;
+             primitiveBounds[primitive] = bounds;
+             
+             int index = leaves[primitive];
+             BVHNode &leaf = nodes[index];
+             leaf.bounds = primitiveBounds[primitives[leaf.first]];
+             for (int i = leaf.first + 1; i < leaf.first + leaf.count; i++) {
+                  leaf.bounds.merge(primitiveBounds[primitives[i]]);
+             }
+             
+             index = leaf.parent;
+             while (index != -1) {
+                  BVHNode &node = nodes[index];
+                  node.bounds = nodes[node.left].bounds;
+                  node.bounds.merge(nodes[node.right].bounds);
+                  index = node.parent;
+             }
+        }
+        
+        // Visits the leaves hit by the ray, nearest child first. The callback receives a primitive
+        // and may shorten 'maxLength' when it finds a closer hit, which prunes the remaining nodes.
+        template <typename Function>
+        void traverse_ray(const Vec3f &origin, const Vec3f &direction, float &maxLength, Function visit) {
+             if (nodes.empty()) return;
+             
+             int stack[maxDepth * 2];
+             int used = 0;
+             float distance = 0.0f;
+             if (!nodes[0].bounds.intersect_ray(origin, direction, maxLength, distance)) return;
+             stack[used++] = 0;
+             
+             while (used > 0) {
+                  BVHNode &node = nodes[stack[--used]];
+                  if (node.is_leaf()) {
+                       for (int i = node.first; i < node.first + node.count; i++) {
+                            visit(primitives[i], maxLength);
+                       }
+                       continue;
+                  }
+                  
+                  float leftDistance = 0.0f, rightDistance = 0.0f;
+                  bool hitLeft = nodes[node.left].bounds.intersect_ray(origin, direction, maxLength, leftDistance);
+                  bool hitRight = nodes[node.right].bounds.intersect_ray(origin, direction, maxLength, rightDistance);
+                  
+                  // Push the far child first so the near one is popped next
+                  if (hitLeft && hitRight) {
+                       bool leftFirst = leftDistance <= rightDistance;
+                       stack[used++] = leftFirst ? node.right : node.left;
+                       stack[used++] = leftFirst ? node.left : node.right;
+                  } else if (hitLeft) {
+                       stack[used++] = node.left;
+                  } else if (hitRight) {
+                       stack[used++] = node.right;
+                  }
+             }
+        }
+        
+        // Packet version of traverse_ray: a node is entered while any ray of the packet still reaches it,
+        // and the child nearest to one of those rays goes first. The callback receives a primitive and
+        // shortens the lengths of the rays it hits.
+        template <typename Function>
+        void traverse_packet(RayPacket &packet, Function visit) {
+             if (nodes.empty() || packet.size == 0) return;
+             
+             int stack[maxDepth * 2];
+             int used = 0;
+             alignas(32) float leftEntry[RayPacket::maxSize];
+             alignas(32) float rightEntry[RayPacket::maxSize];
+             if (PacketKernels::intersect_box(packet, nodes[0].bounds, leftEntry) == 0) return;
+             stack[used++] = 0;
+             
+             while (used > 0) {
+                  BVHNode &node = nodes[stack[--used]];
+                  if (node.is_leaf()) {
+                       for (int i = node.first; i < node.first + node.count; i++) {
+                            visit(primitives[i]);
+                       }
+                       continue;
+                  }
+                  
+                  int hitLeft = PacketKernels::intersect_box(packet, nodes[node.left].bounds, leftEntry);
+                  int hitRight = PacketKernels::intersect_box(packet, nodes[node.right].bounds, rightEntry);
+                  
+                  if (hitLeft && hitRight) {
+                       bool leftFirst = PacketKernels::nearest(leftEntry, hitLeft) <= PacketKernels::nearest(rightEntry, hitRight);
+                       stack[used++] = leftFirst ? node.right : node.left;
+                       stack[used++] = leftFirst ? node.left : node.right;
+                  } else if (hitLeft) {
+                       stack[used++] = node.left;
+                  } else if (hitRight) {
+                       stack[used++] = node.right;
+                  }
+             }
+        }
+        
+        void query_box(const AABB &box, std::vector<int> &result) {
+             query([&](const AABB &bounds) { return box.overlaps(bounds) ? 1 : 0; }, result);
+        }
+        void query_frustum(const Frustum &frustum, std::vector<int> &result) {
+             query([&](const AABB &bounds) { return frustum.classify(bounds); }, result);
+        }
+        
+        // Collects the primitives accepted by 'test', which returns 0 to reject a volume, 1 to
+        // descend into it and 2 to take its whole subtree without further tests
+        template <typename Function>
+        void query(Function test, std::vector<int> &result) {
+             if (nodes.empty()) return;
+             
+             int stack[maxDepth * 2];
+             int used = 0;
+             stack[used++] = 0;
+             
+             while (used > 0) {
+                  BVHNode &node = nodes[stack[--used]];
+                  int classification = test(node.bounds);
+                  if (classification == 0) continue;
+                  
+                  if (node.is_leaf()) {
+                       for (int i = node.first; i < node.first + node.count; i++) {
+                            if (classification == 2 || test(primitiveBounds[primitives[i]]) != 0) {
+                                 result.push_back(primitives[i]);
+                            }
+                       }
+                  } else if (classification == 2) {
+                       collect(node, result);
+                  } else {
+                       stack[used++] = node.left;
+                       stack[used++] = node.right;
+                  }
+             }
+        }
+        
+        bool empty() { return nodes.empty(); }
+        std::vector<BVHNode> &get_nodes() { return nodes; }
+        std::vector<int> &get_primitives() { return primitives; }
+        
+    private:
+        int build_node(int parent, int first, int count, int depth) {
+             int index = nodes.size();
+             nodes.emplace_back();
+             nodes[index].parent = parent;
+             
+             AABB bounds = primitiveBounds[primitives[first]];
+             AABB centroidBounds = AABB(centroids[primitives[first]], centroids[primitives[first]]);
+             for (int i = first + 1; i < first + count; i++) {
+                  bounds.merge(primitiveBounds[primitives[i]]);
+                  centroidBounds.merge(centroids[primitives[i]]);
+             }
+             nodes[index].bounds = bounds;
+             
+             int split = -1;
+             int axis = 0;
+             if (count > 1 && depth < maxDepth - 1) {
+                  split = find_split(first, count, bounds, centroidBounds, axis);
+             }
+             if (split == -1) {
+                  make_leaf(index, first, count);
+                  return index;
+             }
+             
+             // Partition the primitive range around the chosen bin boundary
+             float low = get_axis(centroidBounds.min, axis);
+             float scale = binCount / (get_axis(centroidBounds.max, axis) - low);
+             int *middle = std::partition(&primitives[first], &primitives[first] + count, [&](int primitive) {
+                  return bin_of(get_axis(centroids[primitive], axis), low, scale) < split;
+             });
+             int leftCount = middle - &primitives[first];
+             if (leftCount == 0 || leftCount == count) {
+                  make_leaf(index, first, count);
+                  return index;
+             }
+             
+             int left = build_node(index, first, leftCount, depth + 1);
+             int right = build_node(index, first + leftCount, count - leftCount, depth + 1);
+             nodes[index].left = left;
+             nodes[index].right = right;
+             
+             return index;
+        }
+        
+        // Returns the first bin of the right half, or -1 when keeping a leaf is cheaper
+        int find_split(int first, int count, const AABB &bounds, const AABB &centroidBounds, int &axis) {
+             Vec3f extent = Vec3f(centroidBounds.max).sub(centroidBounds.min);
+             axis = 0;
+             if (extent.y > extent.x) axis = 1;
+             if (extent.z > get_axis(extent, axis)) axis = 2;
+             
+             float low = get_axis(centroidBounds.min, axis);
+             float size = get_axis(extent, axis);
+             if (size <= 1e-6f) return -1;
+             float scale = binCount / size;
+             
+             int binCounts[binCount] = { 0 };
+             AABB binBounds[binCount];
+             for (int i = first; i < first + count; i++) {
+                  int primitive = primitives[i];
+                  int bin = bin_of(get_axis(centroids[primitive], axis), low, scale);
+                  if (binCounts[bin]++ == 0) {
+                       binBounds[bin] = primitiveBounds[primitive];
+                  } else {
+                       binBounds[bin].merge(primitiveBounds[primitive]);
+                  }
+             }
+             
+             // Sweep from the right to get the cost of every right half
+             float rightCosts[binCount] = { 0.0f };
+             AABB accumulated;
+             int accumulatedCount = 0;
+             for (int i = binCount - 1; i > 0; i--) {
+                  if (binCounts[i] > 0) {
+                       if (accumulatedCount == 0) accumulated = binBounds[i];
+                       else accumulated.merge(binBounds[i]);
+                       accumulatedCount += binCounts[i];
+                  }
+                  rightCosts[i] = accumulatedCount > 0 ? accumulated.surface_area() * accumulatedCount : 0.0f;
+             }
+             
+             int best = -1;
+             float bestCost = 0.0f;
+             accumulatedCount = 0;
+             for (int i = 0; i < binCount - 1; i++) {
+                  if (binCounts[i] > 0) {
+                       if (accumulatedCount == 0) accumulated = binBounds[i];
+                       else accumulated.merge(binBounds[i]);
+                       accumulatedCount += binCounts[i];
+                  }
+                  if (accumulatedCount == 0 || accumulatedCount == count) continue;
+                  
+                  float cost = accumulated.surface_area() * accumulatedCount + rightCosts[i + 1];
+                  if (best == -1 || cost < bestCost) {
+                       best = i + 1;
+                       bestCost = cost;
+                  }
+             }
+             if (best == -1) return -1;
+             
+             // Traversing a node costs roughly one primitive test
+             float leafCost = bounds.surface_area() * count;
+             float area = bounds.surface_area();
+             if (count <= maxLeafSize && (area <= 0.0f || bestCost + area >= leafCost)) {
+                  return -1;
+             }
+             return best;
+        }
+        
+        void make_leaf(int index, int first, int count) {
+             nodes[index].first = first;
+             nodes[index].count = count;
+             for (int i = first; i < first + count; i++) {
+                  leaves[primitives[i]] = index;
+             }
+        }
+        void collect(const BVHNode &node, std::vector<int> &result) {
+             if (node.is_leaf()) {
+                  for (int i = node.first; i < node.first + node.count; i++) {
+                       result.push_back(primitives[i]);
+                  }
+                  return;
+             }
+             collect(nodes[node.left], result);
+             collect(nodes[node.right], result);
+        }
+        
+        static float get_axis(const Vec3f &vector, int axis) {
+             return axis == 0 ? vector.x : (axis == 1 ? vector.y : vector.z);
+        }
+        static int bin_of(float value, float low, float scale) {
+             int bin = int((value - low) * scale);
+             return std::min(std::max(bin, 0), binCount - 1);
+        }
+    private:
+        std::vector<BVHNode> nodes;
+        std::vector<int> primitives;
+        std::vector<int> leaves;
+        std::vector<AABB> primitiveBounds;
+        std::vector<Vec3f> centroids;
 };
 
 class Camera {
@@ -345,7 +1118,8 @@ class Camera {
             } else {
                 projMat.set_orthographic(-width / 2, width / 2, -height / 2, height / 2, zNear, zFar);
             }
-            combined = viewMat.multiply(projMat);
+            // Vertices are transformed as projection * view * vertex
+            combined = projMat.multiply(viewMat);
         }
         void resize(float width, float height) {
             this->width = width;
@@ -357,12 +1131,38 @@ class Camera {
         Mat4x4 get_view() {
             return viewMat;
         }
+        Mat4x4 get_combined() {
+            return combined;
+        }
+        Frustum get_frustum() {
+            return Frustum(combined);
+        }
         Vec3f get_direction() {
             Vec3f direction = Vec3f(cos(rotationX) * cos(rotationY),
                                     sin(rotationY),
                                     sin(rotationX) * cos(rotationY));
             return direction;
         }
+        float get_far() {
+            return zFar;
+        }
+        float get_near() {
+            return zNear;
+        }
+        float get_fov() {
+            return fov;
+        }
+        float get_width() {
+            return width;
+        }
+        float get_height() {
+            return height;
+        }
+        // Height in pixels of something 'size' tall, seen from 'distance' away
+        float projected_size(float size, float distance) {
+            if (!perspective) return size;
+            return size * height / (2.0f * std::max(distance, zNear) * tanf(fov * M_PI / 360.0f));
+        }
     protected:
         float fov;
         float zNear, zFar;
@@ -423,61 +1223,404 @@ class CameraControls {
         Camera *camera;
 };
 
-class Shader {
-    public:
-       const char *vertexFile, *fragmentFile;
-       
-       Shader(const char *vertexFile, const char *fragmentFile) {
-            this->vertexFile = vertexFile;
-            this->fragmentFile = fragmentFile;
-            
-            std::string vertContent, fragContent;
-               
-            std::ifstream vert;
-            std::ifstream frag;
-            vert.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-            frag.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-            try {
-                vert.open(vertexFile);
-                frag.open(fragmentFile);
-                
-                std::stringstream stringVert, stringFrag;
-                stringVert << vert.rdbuf();
-                stringFrag << frag.rdbuf();
-                
-                vert.close();
-                frag.close();
-                  
-                vertContent = stringVert.str();
-                fragContent = stringFrag.str();
-             } catch (std::ifstream::failure except) {
-                printf("Couldn't open the shader file: %s\n", except.what());
-             }
-             
-             
-             this->vertex = vertContent.c_str();
-             this->fragment = fragContent.c_str();
-             
-             
-             this->load(this->vertex, this->fragment);
-       }
-       
-       void load(const char *vertSource, const char *fragSource) {
-            int check;
-            char log[512];
-            
-            
-            GLuint vert = glCreateShader(GL_VERTEX_SHADER);
-        	glShaderSource(vert, 1, &vertSource, NULL);
-            glCompileShader(vert);
-               
-            glGetShaderiv(vert, GL_COMPILE_STATUS, &check); 
-            if (!check) {
-                 glGetShaderInfoLog(vert, 512, NULL, log);
-                 printf("%s: %s\n", this->vertexFile, log);
-            }
-            
-            
+// Remembers what's bound so that binding the same thing twice doesn't reach the driver.
+// Every program, vertex array, texture and line width change should go through here.
+namespace GLState {
+    const int maxTextureUnits = 8;
+    
+    GLuint program = 0;
+    GLuint vertexArray = 0;
+    GLenum activeUnit = 0;
+    GLuint textures[maxTextureUnits][3] = {};
+    float lineWidth = 1.0f;
+    
+    int target_index(GLenum target) {
+        switch (target) {
+            case GL_TEXTURE_2D: return 0;
+            case GL_TEXTURE_2D_ARRAY: return 1;
+            default: return 2;
+        }
+    }
+    
+    void use_program(GLuint to) {
+        if (program == to) return;
+        glUseProgram(to);
+        program = to;
+    }
+    void bind_vertex_array(GLuint to) {
+        if (vertexArray == to) return;
+        glBindVertexArray(to);
+        vertexArray = to;
+    }
+    void active_texture(GLenum unit) {
+        if (activeUnit == unit) return;
+        glActiveTexture(GL_TEXTURE0 + unit);
+        activeUnit = unit;
+    }
+    void bind_texture(GLenum target, GLuint texture, GLenum unit = 0) {
+        GLuint &bound = textures[unit][target_index(target)];
+        if (bound == texture && activeUnit == unit) return;
+        active_texture(unit);
+        if (bound != texture) {
+            glBindTexture(target, texture);
+            bound = texture;
+        }
+    }
+    void line_width(float to) {
+        if (lineWidth == to) return;
+        glLineWidth(to);
+        lineWidth = to;
+    }
+    
+    // Deleting an object resets every binding that pointed at it, since its name may be handed out again
+    void delete_program(GLuint &which) {
+        if (program == which) program = 0;
+        glDeleteProgram(which);
+        which = 0;
+    }
+    void delete_vertex_array(GLuint &which) {
+        if (vertexArray == which) vertexArray = 0;
+        glDeleteVertexArrays(1, &which);
+        which = 0;
+    }
+    void delete_texture(GLuint &which) {
+        for (auto &unit : textures) {
+            for (auto &bound : unit) {
+                if (bound == which) bound = 0;
+            }
+        }
+        glDeleteTextures(1, &which);
+        which = 0;
+    }
+};
+
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+// Named CPU and GPU timings kept over the last frames. CPU zones measure the time between
+// begin() and end() with the performance counter and may nest. GPU zones time the commands
+// issued in between through GL_EXT_disjoint_timer_query, when the driver has it. Only one can
+// run at a time, and results are read a few frames later so the CPU never waits for the GPU.
+// A GPU zone run more than once in a frame keeps its last run.
+namespace Timing {
+     const int historySize = 120;
+     const int queryLatency = 4;
+     
+     struct Zone {
+          std::string name;
+          float cpu[historySize] = {}, gpu[historySize] = {};
+          int cpuCount = 0, gpuCount = 0;
+          
+          double cpuThisFrame = 0.0;
+          bool usedThisFrame = false;
+          
+          // One query per frame in flight
+          GLuint queries[queryLatency] = {};
+          bool pending[queryLatency] = {};
+          
+          void add_cpu(float ms) { cpu[cpuCount++ % historySize] = ms; }
+          void add_gpu(float ms) { gpu[gpuCount++ % historySize] = ms; }
+     };
+     
+     struct Running {
+          Zone *zone;
+          Uint64 start;
+          bool gpu;
+     };
+     
+     std::vector<Zone*> zones;
+     std::vector<Running> running;
+     bool gpuTimers = false, gpuBusy = false;
+     int frame = 0;
+     
+     // Checks for timer queries; needs a current context
+     void load() {
+          GLint count = 0;
+          glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+          for (int i = 0; i < count; i++) {
+               const char *extension = (const char*) glGetStringi(GL_EXTENSIONS, i);
+               if (extension != NULL && strcmp(extension, "GL_EXT_disjoint_timer_query") == 0) {
+                    gpuTimers = true;
+               }
+          }
+     }
+     
+     Zone *find(const char *name) {
+          for (auto &zone : zones) {
+               if (zone->name == name) return zone;
+          }
+          Zone *zone = new Zone();
+          zone->name = name;
+          zones.push_back(zone);
+          return zone;
+     }
+     
+     // 'gpu' also times the GL commands, unless another GPU zone is already running
+     void begin(const char *name, bool gpu = false) {
+          Zone *zone = find(name);
+          gpu = gpu && gpuTimers && !gpuBusy;
+          if (gpu) {
+               int slot = frame % queryLatency;
+               if (zone->queries[slot] == 0) glGenQueries(1, &zone->queries[slot]);
+               glBeginQuery(GL_TIME_ELAPSED_EXT, zone->queries[slot]);
+               gpuBusy = true;
+          }
+          running.push_back({ zone, SDL_GetPerformanceCounter(), gpu });
+     }
+     void end() {
+          Running last = running.back();
+          running.pop_back();
+          
+          last.zone->cpuThisFrame += (double) (SDL_GetPerformanceCounter() - last.start) * 1000.0 / SDL_GetPerformanceFrequency();
+          last.zone->usedThisFrame = true;
+          if (last.gpu) {
+               glEndQuery(GL_TIME_ELAPSED_EXT);
+               last.zone->pending[frame % queryLatency] = true;
+               gpuBusy = false;
+          }
+     }
+     
+     // Times the enclosing block
+     class Scope {
+          public:
+             Scope(const char *name, bool gpu = false) { begin(name, gpu); }
+             ~Scope() { end(); }
+     };
+     
+     // Collects the GPU results that came in and starts a new frame
+     void begin_frame() {
+          frame++;
+          if (!gpuTimers) return;
+          
+          // Results spanning a disjoint event, like a clock change, are meaningless
+          GLint disjoint = 0;
+          glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+          for (auto &zone : zones) {
+               for (int slot = 0; slot < queryLatency; slot++) {
+                    if (!zone->pending[slot]) continue;
+                    
+                    GLuint available = 0;
+                    glGetQueryObjectuiv(zone->queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+                    if (!available && slot != frame % queryLatency) continue;
+                    
+                    // The slot is about to be reused, so an unfinished result is dropped
+                    zone->pending[slot] = false;
+                    if (!available || disjoint) continue;
+                    
+                    GLuint nanoseconds = 0;
+                    glGetQueryObjectuiv(zone->queries[slot], GL_QUERY_RESULT, &nanoseconds);
+                    zone->add_gpu(nanoseconds / 1e6f);
+               }
+          }
+     }
+     void end_frame() {
+          for (auto &zone : zones) {
+               if (!zone->usedThisFrame) continue;
+               
+               zone->add_cpu(zone->cpuThisFrame);
+               zone->cpuThisFrame = 0.0;
+               zone->usedThisFrame = false;
+          }
+     }
+     
+     struct Statistics {
+          float average = 0.0f, p50 = 0.0f, p95 = 0.0f;
+          int samples = 0;
+     };
+     Statistics statistics(const float *history, int count) {
+          Statistics result;
+          result.samples = std::min(count, historySize);
+          if (result.samples == 0) return result;
+          
+          std::vector<float> sorted(history, history + result.samples);
+          std::sort(sorted.begin(), sorted.end());
+          for (auto &sample : sorted) result.average += sample;
+          result.average /= result.samples;
+          result.p50 = sorted[(result.samples - 1) / 2];
+          result.p95 = sorted[std::min((int) (result.samples * 0.95f), result.samples - 1)];
+          return result;
+     }
+     
+     // "name  cpu avg (p50, p95)  gpu avg (p50, p95)" in milliseconds
+     std::string describe(Zone *zone) {
+          Statistics cpu = statistics(zone->cpu, zone->cpuCount);
+          Statistics gpu = statistics(zone->gpu, zone->gpuCount);
+          
+          char line[160];
+          int length = snprintf(line, sizeof(line), "%-8s cpu %6.2f (%.2f, %.2f)", zone->name.c_str(), cpu.average, cpu.p50, cpu.p95);
+          if (gpu.samples > 0) {
+               snprintf(line + length, sizeof(line) - length, "  gpu %6.2f (%.2f, %.2f)", gpu.average, gpu.p50, gpu.p95);
+          }
+          return line;
+     }
+     
+     void dispose() {
+          for (auto &zone : zones) {
+               for (auto &query : zone->queries) {
+                    if (query) glDeleteQueries(1, &query);
+               }
+               delete zone;
+          }
+          zones.clear();
+     }
+};
+
+// Worker threads started once and kept for the whole run, which split loops between them.
+// The calling thread takes a part too, so a pool of one runs everything inline.
+class ThreadPool {
+    public:
+       ThreadPool(int threads) {
+           for (int i = 1; i < std::max(threads, 1); i++) {
+               workers.emplace_back([this, i]() { this->work(i); });
+           }
+       }
+       ~ThreadPool() {
+           {
+               std::lock_guard<std::mutex> lock(mutex);
+               stopping = true;
+           }
+           wake.notify_all();
+           for (auto &worker : workers) {
+               worker.join();
+           }
+       }
+       
+       // Calls task(first, last, worker) on one contiguous part of [0, count) per thread, and
+       // returns once every part is done. 'worker' is below get_size() and unique to the part.
+       void run(int count, std::function<void(int, int, int)> task) {
+           {
+               std::lock_guard<std::mutex> lock(mutex);
+               this->task = task;
+               this->count = count;
+               this->remaining = workers.size();
+               this->generation++;
+           }
+           wake.notify_all();
+           
+           run_part(0);
+           
+           std::unique_lock<std::mutex> lock(mutex);
+           done.wait(lock, [this]() { return remaining == 0; });
+       }
+       
+       int get_size() { return workers.size() + 1; }
+    private:
+       void work(int index) {
+           uint64_t seen = 0;
+           while (true) {
+               {
+                   std::unique_lock<std::mutex> lock(mutex);
+                   wake.wait(lock, [&]() { return stopping || generation != seen; });
+                   if (stopping) return;
+                   seen = generation;
+               }
+               run_part(index);
+               {
+                   std::lock_guard<std::mutex> lock(mutex);
+                   remaining--;
+               }
+               done.notify_one();
+           }
+       }
+       void run_part(int index) {
+           int chunk = (count + get_size() - 1) / get_size();
+           int first = std::min(index * chunk, count);
+           int last = std::min(first + chunk, count);
+           if (first < last) task(first, last, index);
+       }
+       
+       std::vector<std::thread> workers;
+       std::mutex mutex;
+       std::condition_variable wake, done;
+       
+       std::function<void(int, int, int)> task;
+       int count = 0, remaining = 0;
+       uint64_t generation = 0;
+       bool stopping = false;
+};
+
+// Per-frame camera data shared by every program through the "Camera" uniform block.
+// The layout follows std140, where a mat4 is four aligned columns, so the matrices are
+// stored as is and read the same way glUniformMatrix4fv would pass them.
+struct CameraBlock {
+    static const GLuint binding = 0;
+    
+    float view[16];
+    float projection[16];
+    float viewProjection[16];
+    float overlayProjection[16];
+};
+
+class Shader {
+    public:
+       const char *vertexFile, *fragmentFile;
+       
+       Shader(const char *vertexFile, const char *fragmentFile) {
+            this->vertexFile = vertexFile;
+            this->fragmentFile = fragmentFile;
+            
+            std::string vertContent, fragContent;
+               
+            std::ifstream vert;
+            std::ifstream frag;
+            vert.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            frag.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            try {
+                vert.open(vertexFile);
+                frag.open(fragmentFile);
+                
+                std::stringstream stringVert, stringFrag;
+                stringVert << vert.rdbuf();
+                stringFrag << frag.rdbuf();
+                
+                vert.close();
+                frag.close();
+                  
+                vertContent = stringVert.str();
+                fragContent = stringFrag.str();
+             } catch (std::ifstream::failure except) {
+                printf("Couldn't open the shader file: %s\n", except.what());
+             }
+             
+             
+             this->vertex = vertContent.c_str();
+             this->fragment = fragContent.c_str();
+             
+             // The driver's binary from an earlier run skips compiling and linking. Drivers may reject
+             // binaries made by other versions, in which case the sources are compiled again.
+             std::string cacheFile = cache_file(vertContent, fragContent);
+             if (this->load_binary(cacheFile)) {
+                  cache_hits()++;
+             } else {
+                  this->load(this->vertex, this->fragment);
+                  this->save_binary(cacheFile);
+                  cache_misses()++;
+             }
+       }
+       
+       static int &cache_hits() { static int count = 0; return count; }
+       static int &cache_misses() { static int count = 0; return count; }
+       
+       void load(const char *vertSource, const char *fragSource) {
+            int check;
+            char log[512];
+            
+            
+            GLuint vert = glCreateShader(GL_VERTEX_SHADER);
+        	glShaderSource(vert, 1, &vertSource, NULL);
+            glCompileShader(vert);
+               
+            glGetShaderiv(vert, GL_COMPILE_STATUS, &check); 
+            if (!check) {
+                 glGetShaderInfoLog(vert, 512, NULL, log);
+                 printf("%s: %s\n", this->vertexFile, log);
+            }
+            
+            
             GLuint fragm = glCreateShader(GL_FRAGMENT_SHADER);
         	glShaderSource(fragm, 1, &fragSource, NULL);
             glCompileShader(fragm);
@@ -491,6 +1634,7 @@ class Shader {
             this->program = glCreateProgram();
             glAttachShader(this->program, vert);
             glAttachShader(this->program, fragm);
+            glProgramParameteri(this->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
             glLinkProgram(this->program);
                
             glGetProgramiv(this->program, GL_LINK_STATUS, &check);
@@ -500,18 +1644,29 @@ class Shader {
             }
             glDeleteShader(vert);
             glDeleteShader(fragm);
+            
+            this->linked();
        }
        void use() {
-           glUseProgram(this->program);
+           GLState::use_program(this->program);
        }
        void clear() {
-           glDeleteProgram(this->program);
+           GLState::delete_program(this->program);
+           uniforms.clear();
+           attributes.clear();
        }
        GLint attribute_location(const char *name) {
-           return glGetAttribLocation(program, name);
+           auto found = attributes.find(name);
+           if (found != attributes.end()) return found->second;
+           
+           return attributes[name] = glGetAttribLocation(program, name);
        }
+       // Names the program doesn't list as active, like single array elements, are looked up once and remembered
        GLint uniform_location(const char *name) {
-           return glGetUniformLocation(program, name);
+           auto found = uniforms.find(name);
+           if (found != uniforms.end()) return found->second;
+           
+           return uniforms[name] = glGetUniformLocation(program, name);
        }
        GLuint get_program() {
            return program;
@@ -548,6 +1703,134 @@ class Shader {
        const char *fragment;
        
        GLuint program;
+       std::unordered_map<std::string, GLint> uniforms, attributes;
+       
+    private:
+       static constexpr const char *cacheDirectory = "shader_cache";
+       
+       // Named after a 64-bit FNV-1a hash of both sources and the driver, so an edited shader
+       // or a driver update never picks up a stale binary
+       std::string cache_file(const std::string &vertSource, const std::string &fragSource) {
+            uint64_t hash = 14695981039346656037ULL;
+            auto add = [&](const char *text) {
+                 if (text == NULL) return;
+                 for (const char *c = text; *c != '\0'; c++) {
+                      hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+                 }
+                 // Keeps "ab" + "c" apart from "a" + "bc"
+                 hash = (hash ^ 0xFF) * 1099511628211ULL;
+            };
+            add(vertSource.c_str());
+            add(fragSource.c_str());
+            add((const char*) glGetString(GL_VENDOR));
+            add((const char*) glGetString(GL_RENDERER));
+            add((const char*) glGetString(GL_VERSION));
+            
+            char name[64];
+            snprintf(name, sizeof(name), "%s/%016llx.bin", cacheDirectory, (unsigned long long) hash);
+            return name;
+       }
+       
+       // The file holds the binary's format followed by the binary itself
+       bool load_binary(const std::string &fileName) {
+            std::ifstream file(fileName, std::ios::binary);
+            if (!file.is_open()) {
+                 return false;
+            }
+            GLenum format = 0;
+            file.read((char*) &format, sizeof(format));
+            std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            if (!file.good() && !file.eof()) {
+                 return false;
+            }
+            
+            // An unknown format would only raise a GL error
+            GLint formatCount = 0;
+            glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+            std::vector<GLint> formats(formatCount);
+            if (formatCount > 0) {
+                 glGetIntegerv(GL_PROGRAM_BINARY_FORMATS, formats.data());
+            }
+            if (std::find(formats.begin(), formats.end(), (GLint) format) == formats.end()) {
+                 return false;
+            }
+            
+            this->program = glCreateProgram();
+            glProgramBinary(this->program, format, binary.data(), binary.size());
+            
+            GLint check = 0;
+            glGetProgramiv(this->program, GL_LINK_STATUS, &check);
+            if (!check) {
+                 printf("%s, %s: cached binary rejected, compiling\n", this->vertexFile, this->fragmentFile);
+                 glDeleteProgram(this->program);
+                 this->program = 0;
+                 return false;
+            }
+            this->linked();
+            return true;
+       }
+       void save_binary(const std::string &fileName) {
+            GLint check = 0, length = 0;
+            glGetProgramiv(this->program, GL_LINK_STATUS, &check);
+            glGetProgramiv(this->program, GL_PROGRAM_BINARY_LENGTH, &length);
+            if (!check || length <= 0) {
+                 return;
+            }
+            std::vector<char> binary(length);
+            GLenum format = 0;
+            glGetProgramBinary(this->program, length, &length, &format, binary.data());
+            
+            mkdir(cacheDirectory, 0755);
+            std::ofstream file(fileName, std::ios::binary);
+            if (!file.is_open()) {
+                 printf("Couldn't write the shader cache file %s\n", fileName.c_str());
+                 return;
+            }
+            file.write((const char*) &format, sizeof(format));
+            file.write(binary.data(), length);
+       }
+       
+       // Called once the program is linked, whether from sources or from a binary
+       void linked() {
+            this->cache_locations();
+            
+            GLuint cameraBlock = glGetUniformBlockIndex(this->program, "Camera");
+            if (cameraBlock != GL_INVALID_INDEX) {
+                glUniformBlockBinding(this->program, cameraBlock, CameraBlock::binding);
+            }
+       }
+       
+       // Resolves every active uniform and attribute right after linking
+       void cache_locations() {
+           uniforms.clear();
+           attributes.clear();
+           
+           char name[256];
+           GLint count = 0, size;
+           GLsizei length;
+           GLenum type;
+           
+           glGetProgramiv(this->program, GL_ACTIVE_UNIFORMS, &count);
+           for (GLint i = 0; i < count; i++) {
+               glGetActiveUniform(this->program, i, sizeof(name), &length, &size, &type, name);
+               std::string key(name, length);
+               GLint location = glGetUniformLocation(this->program, key.c_str());
+               uniforms[key] = location;
+               
+               // Arrays are listed as "name[0]", but they're set through "name"
+               size_t bracket = key.find('[');
+               if (bracket != std::string::npos) {
+                   uniforms[key.substr(0, bracket)] = location;
+               }
+           }
+           
+           glGetProgramiv(this->program, GL_ACTIVE_ATTRIBUTES, &count);
+           for (GLint i = 0; i < count; i++) {
+               glGetActiveAttrib(this->program, i, sizeof(name), &length, &size, &type, name);
+               std::string key(name, length);
+               attributes[key] = glGetAttribLocation(this->program, key.c_str());
+           }
+       }
 };
 
 struct RenderVertex {
@@ -559,7 +1842,7 @@ struct RenderVertex {
     RenderVertex(Vec3f position, Vec3f color = Vec3f(1.0f, 1.0f, 1.0f), Vec3f normal = Vec3f(0.0f, 0.0f, 0.0f)) : Position(position), Color(color), Normal(normal) {}
     
     RenderVertex(float x, float y, float z) : Position(x, y, z), Color(1.0f, 1.0f, 1.0f) {}
-    RenderVertex(float x, float y, float z, float norX, float norY, float norZ) : Position(x, y, z), Normal(norX, norY, norZ) {}
+    RenderVertex(float x, float y, float z, float norX, float norY, float norZ) : Position(x, y, z), Color(1.0f, 1.0f, 1.0f), Normal(norX, norY, norZ) {}
 };
 struct TextureVertex {
     Vec3f Position;
@@ -573,8 +1856,84 @@ struct TextureVertex {
     TextureVertex(float x, float y, float z, float tx, float ty) : Position(x, y, z), TextureCoords(tx, ty) {}
     TextureVertex(float x, float y, float z, float tx, float ty, Vec3f color) : Position(x, y, z), Color(color), TextureCoords(tx, ty) {}
 };
+
+enum class VertexFormats {
+    full,       // RenderVertex, 36 bytes
+    compact     // CompactVertex, 16 bytes
+};
+
+// A RenderVertex packed to 16 bytes. The position is quantized to 16 bits per axis inside the
+// mesh's bounds and comes out of the shader in 0..1, so the instance transform maps it back.
+// The color is RGBA8 and the normal a signed 10-bit triple.
+struct CompactVertex {
+    uint16_t Position[4];
+    uint8_t Color[4];
+    uint32_t Normal;
+    
+    CompactVertex() {}
+    // 'extent' must not have zero components
+    CompactVertex(const RenderVertex &vertex, const Vec3f &origin, const Vec3f &extent) {
+        const float position[] = { vertex.Position.x, vertex.Position.y, vertex.Position.z };
+        const float start[] = { origin.x, origin.y, origin.z };
+        const float size[] = { extent.x, extent.y, extent.z };
+        for (int i = 0; i < 3; i++) {
+            float t = std::min(std::max((position[i] - start[i]) / size[i], 0.0f), 1.0f);
+            Position[i] = (uint16_t) (t * 65535.0f + 0.5f);
+        }
+        Position[3] = 0;
+        
+        const float color[] = { vertex.Color.x, vertex.Color.y, vertex.Color.z, 1.0f };
+        for (int i = 0; i < 4; i++) {
+            Color[i] = (uint8_t) (std::min(std::max(color[i], 0.0f), 1.0f) * 255.0f + 0.5f);
+        }
+        
+        // Normals are stored for the quantized space; dividing by the instance scaling,
+        // which includes the extent, turns them back into the mesh's
+        Vec3f normal = Vec3f(vertex.Normal).mul(extent);
+        Normal = pack_normal(normal.len() > 0.0f ? normal.norm() : normal);
+    }
+    
+    static uint32_t pack_normal(const Vec3f &normal) {
+        auto component = [](float value) -> uint32_t {
+            int scaled = (int) roundf(std::min(std::max(value, -1.0f), 1.0f) * 511.0f);
+            return (uint32_t) scaled & 0x3FF;
+        };
+        return component(normal.x) | (component(normal.y) << 10) | (component(normal.z) << 20);
+    }
+};
+
+// Fixed attribute locations shared by the scene's shaders
+namespace VertexAttributes {
+    const GLuint position = 0;
+    const GLuint color = 1;
+    const GLuint normal = 2;
+    const GLuint instancePosition = 3;
+    const GLuint instanceScaling = 4;
+    const GLuint instanceColor = 5;
+    
+    // Describes vertices of the given format in the bound array buffer to the bound vertex array
+    void setup(VertexFormats format) {
+        if (format == VertexFormats::compact) {
+            glVertexAttribPointer(position, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(CompactVertex), (void*) offsetof(CompactVertex, Position));
+            glVertexAttribPointer(color, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(CompactVertex), (void*) offsetof(CompactVertex, Color));
+            glVertexAttribPointer(normal, 4, GL_INT_2_10_10_10_REV, GL_TRUE, sizeof(CompactVertex), (void*) offsetof(CompactVertex, Normal));
+        } else {
+            glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Position));
+            glVertexAttribPointer(color, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Color));
+            glVertexAttribPointer(normal, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Normal));
+        }
+        glEnableVertexAttribArray(position);
+        glEnableVertexAttribArray(color);
+        glEnableVertexAttribArray(normal);
+    }
+    int stride(VertexFormats format) {
+        return format == VertexFormats::compact ? sizeof(CompactVertex) : sizeof(RenderVertex);
+    }
+};
+
 using RenderVertices = std::vector<RenderVertex>;
 using TextureVertices = std::vector<TextureVertex>;
+using CompactVertices = std::vector<CompactVertex>;
 
 using RenderIndices = std::vector<uint>;
 
@@ -649,12 +2008,11 @@ class TextAtlas {
               }
          }
          void use() {
-              glActiveTexture(GL_TEXTURE0);
-              glBindTexture(GL_TEXTURE_2D, this->textureIndex);
+              GLState::bind_texture(GL_TEXTURE_2D, this->textureIndex);
          }
          
          void dispose() {
-             glDeleteTextures(1, &textureIndex);
+             GLState::delete_texture(textureIndex);
              FT_Done_Face(font);
          }
          
@@ -664,10 +2022,9 @@ class TextAtlas {
          
      private:
          void add_empty_texture() {
-              glActiveTexture(GL_TEXTURE0);
               glGenTextures(1, &textureIndex);
               
-              glBindTexture(GL_TEXTURE_2D, textureIndex);
+              GLState::bind_texture(GL_TEXTURE_2D, textureIndex);
               glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
               
               glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, atlasWidth, atlasHeight, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
@@ -697,8 +2054,7 @@ class SpriteAtlas {
          }
          
          void use() {
-              glActiveTexture(GL_TEXTURE0);
-              glBindTexture(GL_TEXTURE_2D, this->textureIndex);
+              GLState::bind_texture(GL_TEXTURE_2D, this->textureIndex);
          }
          
          
@@ -737,17 +2093,16 @@ class SpriteAtlas {
               this->lastX += width;
          }
          void dispose() {
-              glDeleteTextures(1, &textureIndex);
+              GLState::delete_texture(textureIndex);
          }
          float get_width() { return atlasWidth; }
          float get_height() { return atlasHeight; }
          
      private:
          void initialize() {
-              glActiveTexture(GL_TEXTURE0);
               glGenTextures(1, &textureIndex);
               
-              glBindTexture(GL_TEXTURE_2D, textureIndex);
+              GLState::bind_texture(GL_TEXTURE_2D, textureIndex);
               
               glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, atlasWidth, atlasHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
               
@@ -833,8 +2188,7 @@ class TextureArray {
            this->numberOfTextures = numberOfTextures;
            
            glGenTextures(1, &this->textureIndex);
-           glBindTexture(GL_TEXTURE_2D_ARRAY, this->textureIndex);
-           glActiveTexture(GL_TEXTURE0);
+           GLState::bind_texture(GL_TEXTURE_2D_ARRAY, this->textureIndex);
            
            glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA, textureSize, textureSize, numberOfTextures, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
            
@@ -884,11 +2238,10 @@ class TextureArray {
            SDL_UnlockSurface(source);
        }
        void use() { 
-           glActiveTexture(GL_TEXTURE0);
-           glBindTexture(GL_TEXTURE_2D_ARRAY, this->textureIndex);
+           GLState::bind_texture(GL_TEXTURE_2D_ARRAY, this->textureIndex);
        }
        void clear() {
-           glDeleteTextures(1, &this->textureIndex);
+           GLState::delete_texture(this->textureIndex);
        }
     protected:
        GLuint textureIndex;
@@ -899,17 +2252,137 @@ class TextureArray {
        GLsizei textureSize;
 };
 
+// Vertex or index data streamed through a ring inside one buffer object. Writes are appended through
+// glMapBufferRange without synchronizing, which is safe because nothing queued earlier is overwritten
+// until the ring wraps around. Wrapping invalidates the whole storage, so the driver hands out fresh
+// memory instead of waiting for draws still reading the old one. The ring holds several frames' worth
+// of data, so that only happens every few frames.
+class StreamBuffer {
+    public:
+       static const int frames = 3;
+       
+       StreamBuffer(GLenum target, int frameSize) {
+           this->target = target;
+           this->size = frameSize * frames;
+           this->cursor = 0;
+           
+           glGenBuffers(1, &this->buffer);
+           glBindBuffer(target, this->buffer);
+           glBufferData(target, this->size, nullptr, GL_STREAM_DRAW);
+       }
+       
+       // Maps 'bytes' at the cursor for writing and gives their offset inside the buffer.
+       // Element buffers are bound to the current vertex array, so the caller binds its own first.
+       void *map(int bytes, int &offset) {
+           GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+           access |= (this->cursor == 0) ? GL_MAP_INVALIDATE_BUFFER_BIT : GL_MAP_INVALIDATE_RANGE_BIT;
+           
+           glBindBuffer(this->target, this->buffer);
+           void *memory = glMapBufferRange(this->target, this->cursor, bytes, access);
+           
+           offset = this->cursor;
+           this->cursor += bytes;
+           bytes_this_frame() += bytes;
+           return memory;
+       }
+       void unmap() {
+           glUnmapBuffer(this->target);
+       }
+       
+       int remaining() { return this->size - this->cursor; }
+       
+       // Starts over at the beginning. Anything written but not drawn yet is lost.
+       void wrap() {
+           this->cursor = 0;
+       }
+       // Makes the ring big enough for a single write of 'bytes', dropping its contents if it grows
+       void reserve(int bytes) {
+           if (bytes <= this->size) {
+               return;
+           }
+           this->size = bytes * frames;
+           this->cursor = 0;
+           
+           glBindBuffer(this->target, this->buffer);
+           glBufferData(this->target, this->size, nullptr, GL_STREAM_DRAW);
+       }
+       
+       GLuint get_buffer() { return this->buffer; }
+       
+       void dispose() {
+           if (this->buffer) {
+               glDeleteBuffers(1, &this->buffer);
+           }
+           this->buffer = 0;
+       }
+       
+       // Bytes sent to the GPU by all the stream buffers (and instance uploads) this frame and the last one
+       static long long &bytes_this_frame() {
+           static long long bytes = 0;
+           return bytes;
+       }
+       static long long &bytes_last_frame() {
+           static long long bytes = 0;
+           return bytes;
+       }
+       static void end_frame() {
+           bytes_last_frame() = bytes_this_frame();
+           bytes_this_frame() = 0;
+       }
+    private:
+       GLenum target;
+       GLuint buffer;
+       int size, cursor;
+};
+
+// A uniform buffer attached to one binding point, which the programs' blocks read from
+class UniformBuffer {
+    public:
+       UniformBuffer(GLuint binding, int size) {
+           this->binding = binding;
+           this->size = size;
+           
+           glGenBuffers(1, &this->buffer);
+           glBindBuffer(GL_UNIFORM_BUFFER, this->buffer);
+           glBufferData(GL_UNIFORM_BUFFER, size, NULL, GL_DYNAMIC_DRAW);
+           glBindBufferBase(GL_UNIFORM_BUFFER, binding, this->buffer);
+           glBindBuffer(GL_UNIFORM_BUFFER, 0);
+       }
+       
+       void update(const void *data) {
+           glBindBuffer(GL_UNIFORM_BUFFER, this->buffer);
+           glBufferSubData(GL_UNIFORM_BUFFER, 0, this->size, data);
+           glBindBuffer(GL_UNIFORM_BUFFER, 0);
+       }
+       void dispose() {
+           if (this->buffer) {
+               glDeleteBuffers(1, &this->buffer);
+           }
+           this->buffer = 0;
+       }
+    private:
+       GLuint binding, buffer;
+       int size;
+};
+
 struct BatchType {
     GLenum renderType;
 };
 
+// Geometry streamed every frame. Additions gather on the CPU and go up with a single mapping
+// per stream when drawn. Whenever a frame's worth has gathered the queued part is drawn right
+// away and adding continues, so nothing is dropped.
 class Batch {
     public:
        BatchType type;
-       Batch(int capacity, GLenum renderType, Shader *shader) {
+       // The index capacity defaults to three indices per vertex. Both are per frame;
+       // the streams hold several frames' worth of them.
+       Batch(int capacity, GLenum renderType, Shader *shader, int indexCapacity = 0) {
            this->vertexCapacity = capacity;
-           this->verticesUsed = 0;
-           this->vbo = this->vao = 0;
+           this->indexCapacity = indexCapacity > 0 ? indexCapacity : capacity * 3;
+           this->firstVertex = this->firstIndex = 0;
+           this->uploaded = false;
+           this->vao = 0;
          
            this->type.renderType = renderType;
            this->shader = shader;
@@ -919,86 +2392,202 @@ class Batch {
        
        void setup() {
            glGenVertexArrays(1, &this->vao);
-           glBindVertexArray(this->vao);
-           
-           glGenBuffers(1, &this->vbo);
-           glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
-           glBufferData(GL_ARRAY_BUFFER, this->vertexCapacity * sizeof(RenderVertex), nullptr, GL_STREAM_DRAW); 
+           GLState::bind_vertex_array(this->vao);
            
-           GLint position = this->shader->attribute_location("position");
-           glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Position));
-           glEnableVertexAttribArray(position);
+           this->vertexStream = new StreamBuffer(GL_ARRAY_BUFFER, this->vertexCapacity * sizeof(RenderVertex));
            
-           GLint color = this->shader->attribute_location("color");
-           glVertexAttribPointer(color, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Color));
-           glEnableVertexAttribArray(color);
+           // Created while the vertex array is bound, so it stays attached to it
+           this->indexStream = new StreamBuffer(GL_ELEMENT_ARRAY_BUFFER, this->indexCapacity * sizeof(uint));
            
-           GLint normal = this->shader->attribute_location("normal");
-           glVertexAttribPointer(normal, 3, GL_FLOAT, GL_FALSE, sizeof(RenderVertex), (void*) offsetof(RenderVertex, Normal));
-           glEnableVertexAttribArray(normal);
+           VertexAttributes::setup(VertexFormats::full);
            
-           glBindVertexArray(0);
-           glDisableVertexAttribArray(position);
-           glDisableVertexAttribArray(color);
-           glDisableVertexAttribArray(normal);
+           GLState::bind_vertex_array(0);
            glBindBuffer(GL_ARRAY_BUFFER, 0);
+           glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
        }
        
-       void add(RenderVertices vertices) {
-           int extra = this->get_extra_vertices();
-           if (vertices.size() + extra > vertexCapacity - verticesUsed) {
+       // Adds an indexed mesh. The indices are rebased onto where the vertices land in the batch,
+       // and triangle strips are joined through two repeated indices.
+       void add(const RenderVertices &vertices, const RenderIndices &indices) {
+           if (vertices.empty() || indices.empty()) {
                return;
            }
-           if (vertices.empty()) {
+           
+           // Earlier unindexed vertices need indices of their own, and strips two more to join
+           int sequence = pendingIndices.empty() ? pendingVertices.size() : 0;
+           if (!make_room(vertices.size(), sequence + indices.size() + 2)) {
                return;
            }
-           if (vertices.size() > vertexCapacity) {
-               return;
+           if (pendingIndices.empty() && !pendingVertices.empty()) {
+               index_sequence(0, pendingVertices.size());
            }
+           bool join = (this->type.renderType == GL_TRIANGLE_STRIP && !pendingIndices.empty());
            
-           glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
-           if (extra > 0) {
-               glBufferSubData(GL_ARRAY_BUFFER, (verticesUsed + 0) * sizeof(RenderVertex), sizeof(RenderVertex), &lastUsed);
-               glBufferSubData(GL_ARRAY_BUFFER, (verticesUsed + 1) * sizeof(RenderVertex), sizeof(RenderVertex), &vertices[0]);
+           uint base = pendingVertices.size();
+           if (join) {
+               uint last = pendingIndices.back();
+               pendingIndices.push_back(last);
+               pendingIndices.push_back(indices.front() + base);
            }
-           glBufferSubData(GL_ARRAY_BUFFER, verticesUsed * sizeof(RenderVertex), vertices.size() * sizeof(RenderVertex), &vertices[0]);
-            
-           glBindBuffer(GL_ARRAY_BUFFER, 0);
-           verticesUsed += vertices.size() + extra;
-           lastUsed = vertices.back();
+           for (auto &index : indices) {
+               pendingIndices.push_back(index + base);
+           }
+           append_vertices(vertices, 0);
        }
        
-       void render() {
-           if (verticesUsed == 0) {
+       void add(RenderVertices vertices) {
+           if (vertices.empty()) {
                return;
            }
-           glBindVertexArray(this->vao);
-           glDrawArrays(this->type.renderType, 0, verticesUsed);
+           if (!pendingIndices.empty()) {
+               // Already drawing with indices, so these vertices get a sequence of their own
+               RenderIndices indices(vertices.size());
+               for (int i = 0; i < indices.size(); i++) indices[i] = i;
+               add(vertices, indices);
+               return;
+           }
+           
+           if (!make_room(vertices.size() + this->get_extra_vertices(), 0)) {
+               return;
+           }
+           append_vertices(vertices, this->get_extra_vertices());
+       }
+       
+       void render() {
+           draw();
+           if (!this->keepContents) {
+               clear();
+           }
+       }
+       
+       // A static batch keeps its contents after render(), so geometry that never changes is
+       // uploaded once and drawn again every frame until clear(). It takes no more than fits.
+       Batch *set_static(bool to) {
+           this->keepContents = to;
+           
+           return this;
+       }
+       // Called before every draw, including the ones made early when the batch fills up,
+       // to bind whatever else the batch needs besides its shader
+       Batch *set_draw_listener(std::function<void()> to) {
+           this->drawListener = to;
            
-           this->verticesUsed = 0;
+           return this;
+       }
+       void clear() {
+           pendingVertices.clear();
+           pendingIndices.clear();
+           this->uploaded = false;
        }
        
        
        int get_extra_vertices() {
-           bool mode = (this->type.renderType == GL_TRIANGLE_STRIP && verticesUsed > 0);
+           bool mode = (this->type.renderType == GL_TRIANGLE_STRIP && !pendingVertices.empty());
            return mode ? 2 : 0;
        }
        void dispose() {
-           if (this->vbo) {
-               glDeleteBuffers(1, &this->vbo);
-           }
+           this->vertexStream->dispose();
+           this->indexStream->dispose();
            if (this->vao) {
-               glDeleteBuffers(1, &this->vao);
+               GLState::delete_vertex_array(this->vao);
            }
        }
     protected:
-       int vertexCapacity;
-       int verticesUsed;
-       RenderVertex lastUsed;
+       int vertexCapacity, indexCapacity;
        
-       GLuint vbo;
+       // Queued since the last clear, with indices relative to the first queued vertex
+       RenderVertices pendingVertices;
+       RenderIndices pendingIndices;
+       
+       // Where the queue went in the streams, once uploaded
+       int firstVertex, firstIndex;
+       bool uploaded;
+       
+       bool keepContents = false;
+       
+       StreamBuffer *vertexStream, *indexStream;
        GLuint vao;
        Shader *shader;
+       std::function<void()> drawListener;
+       
+    private:
+       void draw() {
+           if (pendingVertices.empty()) {
+               return;
+           }
+           if (!this->uploaded) {
+               upload();
+           }
+           this->shader->use();
+           if (drawListener != NULL) drawListener();
+           
+           GLState::bind_vertex_array(this->vao);
+           if (!pendingIndices.empty()) {
+               glDrawElements(this->type.renderType, pendingIndices.size(), GL_UNSIGNED_INT, (void*) (firstIndex * sizeof(uint)));
+           } else {
+               glDrawArrays(this->type.renderType, firstVertex, pendingVertices.size());
+           }
+       }
+       
+       // Copies the queue into the streams, mapping each once
+       void upload() {
+           // The element buffer binding belongs to the vertex array, so go through ours
+           GLState::bind_vertex_array(this->vao);
+           
+           int offset = 0;
+           int vertexBytes = pendingVertices.size() * sizeof(RenderVertex);
+           vertexStream->reserve(vertexBytes);
+           if (vertexBytes > vertexStream->remaining()) vertexStream->wrap();
+           char *vertexTarget = (char*) vertexStream->map(vertexBytes, offset);
+           memcpy(vertexTarget, (const char*) &pendingVertices[0], vertexBytes);
+           vertexStream->unmap();
+           firstVertex = offset / sizeof(RenderVertex);
+           
+           if (!pendingIndices.empty()) {
+               int indexBytes = pendingIndices.size() * sizeof(uint);
+               indexStream->reserve(indexBytes);
+               if (indexBytes > indexStream->remaining()) indexStream->wrap();
+               uint *indexTarget = (uint*) indexStream->map(indexBytes, offset);
+               for (int i = 0; i < pendingIndices.size(); i++) {
+                   indexTarget[i] = pendingIndices[i] + firstVertex;
+               }
+               indexStream->unmap();
+               firstIndex = offset / sizeof(uint);
+           }
+           
+           GLState::bind_vertex_array(0);
+           glBindBuffer(GL_ARRAY_BUFFER, 0);
+           this->uploaded = true;
+       }
+       
+       // Draws what's queued when a frame's worth of room can't take the next addition
+       bool make_room(int vertexCount, int indexCount) {
+           if ((int) pendingVertices.size() + vertexCount <= vertexCapacity && (int) pendingIndices.size() + indexCount <= indexCapacity) {
+               return true;
+           }
+           if (this->keepContents) {
+               return false;
+           }
+           // A single addition bigger than that goes alone; the streams grow to fit it
+           draw();
+           clear();
+           return true;
+       }
+       
+       // Appends the vertices, preceded by 'extra' joining vertices
+       void append_vertices(const RenderVertices &vertices, int extra) {
+           if (extra > 0) {
+               RenderVertex last = pendingVertices.back();
+               pendingVertices.push_back(last);
+               pendingVertices.push_back(vertices[0]);
+           }
+           pendingVertices.insert(pendingVertices.end(), vertices.begin(), vertices.end());
+           this->uploaded = false;
+       }
+       // Indices first .. first + count - 1
+       void index_sequence(int first, int count) {
+           for (int i = 0; i < count; i++) pendingIndices.push_back(first + i);
+       }
 };
 
 class TextureBatch {
@@ -1006,8 +2595,7 @@ class TextureBatch {
        BatchType type;
        TextureBatch(int capacity, GLenum renderType, Shader *shader) {
            this->vertexCapacity = capacity;
-           this->verticesUsed = 0;
-           this->vbo = this->vao = 0;
+           this->vao = 0;
          
            this->type.renderType = renderType;
            this->shader = shader;
@@ -1017,11 +2605,9 @@ class TextureBatch {
        
        void setup() {
            glGenVertexArrays(1, &this->vao);
-           glBindVertexArray(this->vao);
+           GLState::bind_vertex_array(this->vao);
            
-           glGenBuffers(1, &this->vbo);
-           glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
-           glBufferData(GL_ARRAY_BUFFER, this->vertexCapacity * sizeof(TextureVertex), nullptr, GL_STREAM_DRAW); 
+           this->vertexStream = new StreamBuffer(GL_ARRAY_BUFFER, this->vertexCapacity * sizeof(TextureVertex));
            
            GLint position = this->shader->attribute_location("position");
            glVertexAttribPointer(position, 3, GL_FLOAT, GL_FALSE, sizeof(TextureVertex), (void*) offsetof(TextureVertex, Position));
@@ -1035,68 +2621,218 @@ class TextureBatch {
            glVertexAttribPointer(textureCoords, 2, GL_FLOAT, GL_FALSE, sizeof(TextureVertex), (void*) offsetof(TextureVertex, TextureCoords));
            glEnableVertexAttribArray(textureCoords);
            
-           glBindVertexArray(0);
+           GLState::bind_vertex_array(0);
            glDisableVertexAttribArray(position);
            glDisableVertexAttribArray(color);
            glDisableVertexAttribArray(textureCoords);
            glBindBuffer(GL_ARRAY_BUFFER, 0);
        }
        
+       // Queued on the CPU; render() sends everything up with one mapping
        void add(TextureVertices vertices) {
-           int extra = this->get_extra_vertices();
-           if (vertices.size() + extra > vertexCapacity - verticesUsed) {
-               return;
-           }
            if (vertices.empty()) {
                return;
            }
-           if (vertices.size() > vertexCapacity) {
-               return;
+           if ((int) (pendingVertices.size() + vertices.size()) + this->get_extra_vertices() > vertexCapacity) {
+               // Out of room for a frame, so draw what's queued and start over
+               render();
            }
            
-           glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
-           if (extra > 0) {
-               glBufferSubData(GL_ARRAY_BUFFER, (verticesUsed + 0) * sizeof(TextureVertex), sizeof(TextureVertex), &lastUsed);
-               glBufferSubData(GL_ARRAY_BUFFER, (verticesUsed + 1) * sizeof(TextureVertex), sizeof(TextureVertex), &vertices[0]);
+           if (this->get_extra_vertices() > 0) {
+               TextureVertex last = pendingVertices.back();
+               pendingVertices.push_back(last);
+               pendingVertices.push_back(vertices[0]);
            }
-           glBufferSubData(GL_ARRAY_BUFFER, verticesUsed * sizeof(TextureVertex), vertices.size() * sizeof(TextureVertex), &vertices[0]);
-            
-           glBindBuffer(GL_ARRAY_BUFFER, 0);
-           verticesUsed += vertices.size() + extra;
-           lastUsed = vertices.back();
+           pendingVertices.insert(pendingVertices.end(), vertices.begin(), vertices.end());
        }
        
        void render() {
-           if (verticesUsed == 0) {
+           if (pendingVertices.empty()) {
                return;
            }
-           glBindVertexArray(this->vao);
-           glDrawArrays(this->type.renderType, 0, verticesUsed);
+           int offset = 0;
+           int bytes = pendingVertices.size() * sizeof(TextureVertex);
+           vertexStream->reserve(bytes);
+           if (bytes > vertexStream->remaining()) vertexStream->wrap();
+           char *target = (char*) vertexStream->map(bytes, offset);
+           memcpy(target, (const char*) &pendingVertices[0], bytes);
+           vertexStream->unmap();
+           glBindBuffer(GL_ARRAY_BUFFER, 0);
+           
+           this->shader->use();
+           if (drawListener != NULL) drawListener();
            
-           this->verticesUsed = 0;
+           GLState::bind_vertex_array(this->vao);
+           glDrawArrays(this->type.renderType, offset / sizeof(TextureVertex), pendingVertices.size());
+           
+           pendingVertices.clear();
        }
        
+       // Called before every draw, including the ones made early when the batch fills up,
+       // to bind the texture and uniforms the batch needs
+       TextureBatch *set_draw_listener(std::function<void()> to) {
+           this->drawListener = to;
+           
+           return this;
+       }
        
        int get_extra_vertices() {
-           bool mode = (this->type.renderType == GL_TRIANGLE_STRIP && verticesUsed > 0);
+           bool mode = (this->type.renderType == GL_TRIANGLE_STRIP && !pendingVertices.empty());
            return mode ? 2 : 0;
        }
        void dispose() {
-           if (this->vbo) {
-               glDeleteBuffers(1, &this->vbo);
-           }
+           this->vertexStream->dispose();
            if (this->vao) {
-               glDeleteBuffers(1, &this->vao);
+               GLState::delete_vertex_array(this->vao);
            }
        }
     protected:
        int vertexCapacity;
-       int verticesUsed;
-       TextureVertex lastUsed;
+       TextureVertices pendingVertices;
        
-       GLuint vbo;
+       StreamBuffer *vertexStream;
        GLuint vao;
        Shader *shader;
+       std::function<void()> drawListener;
+};
+
+// Offscreen target where every object is drawn in a flat color that encodes its ID.
+// The pixel under the cursor is copied into a pixel buffer object and only mapped once
+// its fence has signaled, so reading it back never waits on the GPU.
+class PickingBuffer {
+    public:
+       static const int readSlots = 3;
+       
+       PickingBuffer(int width, int height) {
+           this->width = width;
+           this->height = height;
+           this->fbo = this->colorBuffer = this->depthBuffer = 0;
+           this->nextSlot = 0;
+           for (int i = 0; i < readSlots; i++) {
+               fences[i] = 0;
+           }
+           
+           setup();
+       }
+       
+       void setup() {
+           glGenRenderbuffers(1, &this->colorBuffer);
+           glBindRenderbuffer(GL_RENDERBUFFER, this->colorBuffer);
+           glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+           
+           glGenRenderbuffers(1, &this->depthBuffer);
+           glBindRenderbuffer(GL_RENDERBUFFER, this->depthBuffer);
+           glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+           glBindRenderbuffer(GL_RENDERBUFFER, 0);
+           
+           glGenFramebuffers(1, &this->fbo);
+           glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+           glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, this->colorBuffer);
+           glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, this->depthBuffer);
+           if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+               printf("The picking framebuffer is incomplete.\n");
+           }
+           glBindFramebuffer(GL_FRAMEBUFFER, 0);
+           
+           glGenBuffers(readSlots, this->pbos);
+           for (int i = 0; i < readSlots; i++) {
+               glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[i]);
+               glBufferData(GL_PIXEL_PACK_BUFFER, 4, nullptr, GL_STREAM_READ);
+           }
+           glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+       }
+       
+       void begin() {
+           glGetIntegerv(GL_VIEWPORT, this->lastViewport);
+           glBindFramebuffer(GL_FRAMEBUFFER, this->fbo);
+           glViewport(0, 0, width, height);
+           
+           glDisable(GL_BLEND);
+           glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+           glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+       }
+       void end() {
+           glBindFramebuffer(GL_FRAMEBUFFER, 0);
+           glViewport(lastViewport[0], lastViewport[1], lastViewport[2], lastViewport[3]);
+           glEnable(GL_BLEND);
+       }
+       
+       // Queues a copy of one pixel, in normalized coordinates with the origin at the bottom left
+       void request(float u, float v) {
+           if (fences[nextSlot] != 0) {
+               // Every slot is still in flight, skip this frame
+               return;
+           }
+           int x = std::min(std::max(int(u * width), 0), width - 1);
+           int y = std::min(std::max(int(v * height), 0), height - 1);
+           
+           glBindFramebuffer(GL_READ_FRAMEBUFFER, this->fbo);
+           glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[nextSlot]);
+           glReadPixels(x, y, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+           glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+           glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+           
+           fences[nextSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+           nextSlot = (nextSlot + 1) % readSlots;
+       }
+       
+       // Takes the newest finished read. Returns false if none has completed since the last call,
+       // otherwise 'id' holds the object ID (0 for the background).
+       bool poll(uint &id) {
+           bool found = false;
+           for (int i = 0; i < readSlots; i++) {
+               // Oldest request first
+               int slot = (nextSlot + i) % readSlots;
+               if (fences[slot] == 0) continue;
+               
+               GLenum status = glClientWaitSync(fences[slot], 0, 0);
+               if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED) break;
+               glDeleteSync(fences[slot]);
+               fences[slot] = 0;
+               
+               glBindBuffer(GL_PIXEL_PACK_BUFFER, this->pbos[slot]);
+               GLubyte *pixel = (GLubyte*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4, GL_MAP_READ_BIT);
+               if (pixel != nullptr) {
+                   id = pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+                   found = true;
+                   glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+               }
+               glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+           }
+           return found;
+       }
+       
+       // Drops reads in flight, e.g. after the IDs they refer to changed
+       void discard() {
+           for (int i = 0; i < readSlots; i++) {
+               if (fences[i] != 0) {
+                   glDeleteSync(fences[i]);
+                   fences[i] = 0;
+               }
+           }
+       }
+       
+       // 24-bit IDs, one byte per color channel
+       static Vec3f encode(uint id) {
+           return Vec3f((id & 0xff) / 255.0f, ((id >> 8) & 0xff) / 255.0f, ((id >> 16) & 0xff) / 255.0f);
+       }
+       
+       void dispose() {
+           discard();
+           glDeleteBuffers(readSlots, this->pbos);
+           glDeleteFramebuffers(1, &this->fbo);
+           glDeleteRenderbuffers(1, &this->colorBuffer);
+           glDeleteRenderbuffers(1, &this->depthBuffer);
+       }
+    protected:
+       int width, height;
+       GLint lastViewport[4];
+       
+       GLuint fbo;
+       GLuint colorBuffer, depthBuffer;
+       GLuint pbos[readSlots];
+       GLsync fences[readSlots];
+       int nextSlot;
 };
 
 namespace Renderer {
@@ -1107,7 +2843,16 @@ namespace Renderer {
      TextureBatch *uiBatch;
      Shader *overlayShader;
      
+     UniformBuffer *cameraBuffer;
+     CameraBlock cameraBlock;
+     
+     // What the scene needs to render, without the overlay
+     void load_camera() {
+           cameraBuffer = new UniformBuffer(CameraBlock::binding, sizeof(CameraBlock));
+     }
      void load() {
+           load_camera();
+           
            overlayShader = new Shader("overlay.vert", "overlay.frag"); 
            textBatch = new TextureBatch(4096, GL_TRIANGLES, overlayShader);
            uiBatch = new TextureBatch(1000, GL_TRIANGLES, overlayShader);
@@ -1119,6 +2864,16 @@ namespace Renderer {
      
            atlas->add_entry("checkbox-on", "checkbox_on.png");
            atlas->add_entry("checkbox-off", "checkbox_off.png");
+           
+           // Either batch may draw early when its stream fills up, so each one binds its own texture
+           uiBatch->set_draw_listener([]() {
+                overlayShader->set_uniform_bool("renderingText", false);
+                atlas->use();
+           });
+           textBatch->set_draw_listener([]() {
+                overlayShader->set_uniform_bool("renderingText", true);
+                textAtlas->use();
+           });
      }
      
      void draw_string(const std::string &text, float x, float y, float sclX, float sclY, const Vec3f &color) {
@@ -1229,8 +2984,21 @@ namespace Renderer {
            uiBatch->add(vertices);
      }
      
+     // The overlay projection only changes with the screen size; it goes up with the next frame
+     void set_overlay_projection(const Mat4x4 &projection) {
+           memcpy(cameraBlock.overlayProjection, projection.values, sizeof(cameraBlock.overlayProjection));
+     }
+     // Uploads the camera's matrices for every program at once
+     void begin_frame(Camera *camera) {
+           memcpy(cameraBlock.view, camera->get_view().values, sizeof(cameraBlock.view));
+           memcpy(cameraBlock.projection, camera->get_projection().values, sizeof(cameraBlock.projection));
+           memcpy(cameraBlock.viewProjection, camera->get_combined().values, sizeof(cameraBlock.viewProjection));
+           cameraBuffer->update(&cameraBlock);
+     }
+     
      void dispose() {
            overlayShader->clear();
+           cameraBuffer->dispose();
            textBatch->dispose();
            uiBatch->dispose();
            
@@ -1423,6 +3191,27 @@ class Label : public Cell {
          std::string text;
 };
 
+// Lists the timing zones one per line, going down from its position
+class TimingPanel : public Cell {
+     public:
+         TimingPanel() : Cell() {
+              color = UIPallete::textColor;
+         }
+         
+         void render() override {
+              float y = position.y;
+              Renderer::draw_string("ms: average (p50, p95)", position.x, y, scale, scale, color);
+              for (auto &zone : Timing::zones) {
+                   y -= lineHeight;
+                   Renderer::draw_string(Timing::describe(zone), position.x, y, scale, scale, color);
+              }
+         }
+     private:
+         const float scale = 0.3f;
+         const float lineHeight = 13.0f;
+         Vec3f color;
+};
+
 class CheckBox : public Cell {
      public:
          CheckBox(std::string label, bool checked) : Cell() {
@@ -1581,6 +3370,8 @@ class TextField : public Cell {
          }
          TextField *set_text(const std::string &to) {
               this->text = to;
+              
+              return this;
          }
          std::string &get_text() { return this->text; }
      private:
@@ -1759,6 +3550,11 @@ class Table {
              return this;
         }
         bool is_visible() { return this->visible; }
+        
+        bool point_inside(float x, float y) {
+             return visible && (x >= position.x - width / 2.0f && x < position.x + width / 2.0f) &&
+                               (y >= position.y - height / 2.0f && y < position.y + height / 2.0f);
+        }
          
      private:
         Vec2f position;
@@ -1778,143 +3574,1360 @@ class Table {
         std::string label;
 };
 
-struct Mesh {
-     RenderVertices renderVertices;
-     RenderIndices indices;
-     Mesh() {}
-     Mesh(RenderVertices vertices, RenderIndices indices) : renderVertices(vertices), indices(indices) {}
-     
-     Mesh set_color(const Vec3f color) {
-          for (auto &vertex : renderVertices) {
-               vertex.Color = color;
-          }
-          
-          return *this;
-     }
-     Mesh set_color(float r, float g, float b) {
-          return set_color(Vec3f(r, g, b));
-     }
-     uint max_index() {
-          uint result = 0;
-          for (auto &index : indices) {
-               if (index > result) result = index;
-          }
-          
-          return result;
-     }
-};
-
-// A batched object
-class SceneObject {
-     public:
-        Vec3f position, scaling;
-        
-        SceneObject(Mesh mesh) {
-             this->mesh = mesh;
-             
-             position = Vec3f(0.0f, 0.0f, 0.0f);
-             scaling = Vec3f(1.0f, 1.0f, 1.0f);
-             boundingBox = AABB(Vec3f(-0.5f, -0.5f, -0.5f), Vec3f(0.5f, 0.5f, 0.5f));
-        }
-        
-        void render(Batch *batch) {
-             if (mesh.indices.empty()) return;
-             
-             RenderVertices vertices;
-             Vec3f minimum, maximum;
-             minimum = maximum = Vec3f(mesh.renderVertices.at(0).Position);
-             
-             for (auto &index : mesh.indices) {
-                  RenderVertex vertex = mesh.renderVertices.at(index);
-                  
-                  // X coordinates
-                  if (vertex.Position.x < minimum.x) minimum.x = vertex.Position.x;
-                  if (vertex.Position.x > maximum.x) maximum.x = vertex.Position.x;
-              
-                  // Y coordinates
-                  if (vertex.Position.y < minimum.y) minimum.y = vertex.Position.y;
-                  if (vertex.Position.y > maximum.y) maximum.y = vertex.Position.y;
-                  
-                  // Z coordinates
-                  if (vertex.Position.z < minimum.z) minimum.z = vertex.Position.z;
-                  if (vertex.Position.z > maximum.z) maximum.z = vertex.Position.z;
-             }
-             
-             for (auto &index : mesh.indices) {
-                  RenderVertex vertex = mesh.renderVertices.at(index);
-                  
-                  vertex.Position.mul(this->scaling);
-                  vertex.Position.add(this->position);
-                  
-                  vertices.emplace_back(vertex);
-             }
-             this->boundingBox.min = minimum.mul(scaling).add(position);
-             this->boundingBox.max = maximum.mul(scaling).add(position);
-             
-             batch->add(vertices);
-        }
-        Mesh &get_mesh() { return this->mesh; }
-        AABB &get_bounding_box() { return this->boundingBox; }
-        
-        SceneObject *set_position(const Vec3f &to) {
-             this->position = to;
-            
-             return this;
-        }
-        SceneObject *set_scaling(const Vec3f &to) {
-             this->scaling = to;
-            
-             return this;
-        }
-        SceneObject *set_position(float x, float y, float z) {
-             this->position = Vec3f(x, y, z);
-            
-             return this;
-        }
-        SceneObject *set_scaling(float width, float height, float depth) {
-             this->scaling = Vec3f(width, height, depth);
-            
-             return this;
-        }
-     private:
-        Mesh mesh;
-        AABB boundingBox;
-};
-
-
-namespace BaseMeshes {
-     const RenderVertices cubeVertices = {
-         //           Position         normal
-         RenderVertex(-0.5, -0.5, 0.5,  0.0, 0.0, 1.0),
-         RenderVertex(0.5, -0.5, 0.5,  0.0, 0.0, 1.0),
-         RenderVertex(0.5, 0.5, 0.5,  0.0, 0.0, 1.0),
-         RenderVertex(-0.5, 0.5, 0.5,  0.0, 0.0, 1.0),
+// Low resolution software depth buffer for occlusion culling. A few large occluders are
+// rasterized on the CPU, then reduced into a chain of levels where each texel keeps the
+// farthest depth below it, so a box only needs a handful of texel reads to be tested.
+// It doesn't touch OpenGL and the results only depend on its inputs.
+//
+// An occluder claims a texel when it covers all four of its corners, with the farthest depth
+// it has over them. For occluders with convex outlines that means the whole texel, so mistakes
+// can only keep objects that are actually hidden. Occluders with notches, holes or gaps
+// narrower than a texel can still claim the texel around them and wrongly cull what shows
+// through.
+class OcclusionBuffer {
+    public:
+       // Multiples of 4 so rows can be processed 4 pixels at a time
+       static const int width = 256;
+       static const int height = 128;
        
-         RenderVertex(-0.5, 0.5, 0.5,  0.0, 1.0, 0.0),
-         RenderVertex(0.5, 0.5, 0.5,  0.0, 1.0, 0.0),
-         RenderVertex(0.5, 0.5, -0.5,  0.0, 1.0, 0.0),
-         RenderVertex(-0.5, 0.5, -0.5,  0.0, 1.0, 0.0),
+       OcclusionBuffer() {
+           corners.assign(cornerStride * (height + 1), uncovered);
+           
+           int w = width, h = height;
+           while (w >= 1 && h >= 1) {
+               levels.push_back(std::vector<float>(w * h, 1.0f));
+               levelSizes.push_back(Vec2i { w, h });
+               w /= 2;
+               h /= 2;
+           }
+       }
        
-         RenderVertex(0.5, -0.5, -0.5,  0.0, 0.0, -1.0),
-         RenderVertex(-0.5, -0.5, -0.5,  0.0, 0.0, -1.0),
-         RenderVertex(-0.5, 0.5, -0.5,  0.0, 0.0, -1.0),
-         RenderVertex(0.5, 0.5, -0.5,  0.0, 0.0, -1.0),
+       // Starts a frame with a view-projection matrix that maps column vectors
+       void begin(const Mat4x4 &combined) {
+           this->combined = combined;
+           std::fill(levels[0].begin(), levels[0].end(), 1.0f);
+       }
        
-         RenderVertex(-0.5, -0.5, -0.5,  0.0, -1.0, 0.0),
-         RenderVertex(0.5, -0.5, -0.5,  0.0, -1.0, 0.0),
-         RenderVertex(0.5, -0.5, 0.5,  0.0, -1.0, 0.0),
-         RenderVertex(-0.5, -0.5, 0.5, 0.0, -1.0, 0.0),
+       // Rasterizes a mesh moved by the same scaling and translation as a SceneObject. The mesh
+       // covers a texel when its triangles together cover all four corners, which is conservative
+       // only for meshes with convex outlines; see the class comment.
+       void add_occluder(const RenderVertices &vertices, const RenderIndices &indices, const Vec3f &scaling, const Vec3f &position) {
+           projected.resize(vertices.size());
+           for (int i = 0; i < vertices.size(); i++) {
+               Vec3f world = Vec3f(vertices[i].Position).mul(scaling).add(position);
+               projected[i] = project(world);
+           }
+           
+           touchedX1 = touchedY1 = INT_MAX;
+           touchedX2 = touchedY2 = -1;
+           for (int i = 0; i + 2 < indices.size(); i += 3) {
+               rasterize_triangle(projected[indices[i]], projected[indices[i + 1]], projected[indices[i + 2]]);
+           }
+           if (touchedX2 < 0) return;
+           
+           resolve_corners();
+           for (int y = touchedY1; y <= touchedY2; y++) {
+               std::fill(&corners[y * cornerStride + touchedX1], &corners[y * cornerStride + touchedX2 + 1], uncovered);
+           }
+       }
        
-         RenderVertex(-0.5, -0.5, -0.5,  -1.0, 0.0, 0.0),
-         RenderVertex(-0.5, -0.5, 0.5,  -1.0, 0.0, 0.0),
-         RenderVertex(-0.5, 0.5, 0.5,  -1.0, 0.0, 0.0),
-         RenderVertex(-0.5, 0.5, -0.5,  -1.0, 0.0, 0.0),
+       // Whether to use the SSE2 loops where they're compiled in. Both give the same buffer.
+       OcclusionBuffer *set_vectorized(bool to) {
+           this->vectorized = to;
+           
+           return this;
+       }
        
-         RenderVertex(0.5, -0.5, 0.5,  1.0, 0.0, 0.0),
-         RenderVertex(0.5, -0.5, -0.5,  1.0, 0.0, 0.0),
-         RenderVertex(0.5, 0.5, -0.5,  1.0, 0.0, 0.0),  
-         RenderVertex(0.5, 0.5, 0.5,  1.0, 0.0, 0.0)
-     };
+       // Reduces the depth buffer into the coarser levels
+       void build_hierarchy() {
+           for (int level = 1; level < levels.size(); level++) {
+               reduce(levels[level - 1], levelSizes[level - 1].x, levels[level], levelSizes[level].x, levelSizes[level].y);
+           }
+       }
+       
+       // True when the whole box lies behind the occluders already drawn
+       bool is_occluded(const AABB &box) {
+           float minX = width, minY = height, maxX = -1.0f, maxY = -1.0f;
+           float nearest = 1.0f;
+           for (int i = 0; i < 8; i++) {
+               Vec3f corner = Vec3f(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y, i & 4 ? box.max.z : box.min.z);
+               ScreenPoint point = project(corner);
+               
+               // Crossing the near plane means it can't be bounded on the screen
+               if (!point.valid) return false;
+               minX = std::min(minX, point.x);
+               maxX = std::max(maxX, point.x);
+               minY = std::min(minY, point.y);
+               maxY = std::max(maxY, point.y);
+               nearest = std::min(nearest, point.depth);
+           }
+           if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height) return false;
+           
+           int x1 = std::max(int(minX), 0), x2 = std::min(int(maxX), width - 1);
+           int y1 = std::max(int(minY), 0), y2 = std::min(int(maxY), height - 1);
+           
+           // Pick the level where the rectangle covers at most 2x2 texels, plus one on the edges
+           int level = 0;
+           int span = std::max(x2 - x1, y2 - y1);
+           while (span > 1 && level < levels.size() - 1) {
+               span >>= 1;
+               level++;
+           }
+           
+           std::vector<float> &depth = levels[level];
+           int levelWidth = levelSizes[level].x;
+           for (int y = y1 >> level; y <= (y2 >> level); y++) {
+               for (int x = x1 >> level; x <= (x2 >> level); x++) {
+                   if (nearest <= depth[y * levelWidth + x]) return false;
+               }
+           }
+           return true;
+       }
+       
+       std::vector<float> &get_level(int level) { return levels.at(level); }
+       int get_level_count() { return levels.size(); }
+       
+    private:
+       struct ScreenPoint {
+           float x, y;
+           
+           // Window depth in [0, 1]
+           float depth;
+           bool valid;
+       };
+       
+       ScreenPoint project(const Vec3f &point) {
+           const float *m = combined.values;
+           float x = m[0] * point.x + m[1] * point.y + m[2] * point.z + m[3];
+           float y = m[4] * point.x + m[5] * point.y + m[6] * point.z + m[7];
+           float z = m[8] * point.x + m[9] * point.y + m[10] * point.z + m[11];
+           float w = m[12] * point.x + m[13] * point.y + m[14] * point.z + m[15];
+           
+           ScreenPoint result;
+           result.valid = w > 1e-5f;
+           if (!result.valid) return result;
+           
+           result.x = (x / w * 0.5f + 0.5f) * width;
+           result.y = (y / w * 0.5f + 0.5f) * height;
+           result.depth = z / w * 0.5f + 0.5f;
+           return result;
+       }
+       
+       // Edge function rasterizer sampling the texel corners, keeping the nearest depth of the
+       // occluder's triangles at each. Corners on an edge count as inside, so neighbouring
+       // triangles leave no gaps between them.
+       void rasterize_triangle(ScreenPoint a, ScreenPoint b, ScreenPoint c) {
+           // Triangles through the near plane are skipped, which only loses occlusion
+           if (!a.valid || !b.valid || !c.valid) return;
+           
+           float area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+           if (fabs(area) < 1e-8f) return;
+           if (area < 0.0f) {
+               std::swap(b, c);
+               area = -area;
+           }
+           
+           int x1 = std::max(int(ceil(std::min(a.x, std::min(b.x, c.x)))), 0);
+           int x2 = std::min(int(floor(std::max(a.x, std::max(b.x, c.x)))), width);
+           int y1 = std::max(int(ceil(std::min(a.y, std::min(b.y, c.y)))), 0);
+           int y2 = std::min(int(floor(std::max(a.y, std::max(b.y, c.y)))), height);
+           if (x1 > x2 || y1 > y2) return;
+           x1 &= ~3;
+           
+           // Every corner the four wide steps can write, so all of them get cleared again
+           touchedX1 = std::min(touchedX1, x1);
+           touchedX2 = std::max(touchedX2, std::min(x2 | 3, cornerStride - 1));
+           touchedY1 = std::min(touchedY1, y1);
+           touchedY2 = std::max(touchedY2, y2);
+           
+           // Depth as a plane over the screen
+           float inverseArea = 1.0f / area;
+           float dzdx = ((b.depth - a.depth) * (c.y - a.y) - (c.depth - a.depth) * (b.y - a.y)) * inverseArea;
+           float dzdy = ((c.depth - a.depth) * (b.x - a.x) - (b.depth - a.depth) * (c.x - a.x)) * inverseArea;
+           
+           // Edge functions are linear: e(x, y) = stepX * x + stepY * y + offset
+           float e0x = b.y - c.y, e0y = c.x - b.x, e0 = b.x * c.y - b.y * c.x;
+           float e1x = c.y - a.y, e1y = a.x - c.x, e1 = c.x * a.y - c.y * a.x;
+           float e2x = a.y - b.y, e2y = b.x - a.x, e2 = a.x * b.y - a.y * b.x;
+           
+           // Both paths evaluate the same expressions in the same order
+           for (int y = y1; y <= y2; y++) {
+               float py = y;
+               float row0 = e0y * py + e0, row1 = e1y * py + e1, row2 = e2y * py + e2;
+               float rowDepth = a.depth + dzdy * (py - a.y);
+               float *row = &corners[y * cornerStride];
+               
+               for (int x = x1; x <= x2; x += 4) {
+#if defined(__SSE2__)
+                   if (vectorized) {
+                       __m128 xs = _mm_add_ps(_mm_set1_ps(x), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+                       __m128 w0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e0x), xs), _mm_set1_ps(row0));
+                       __m128 w1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e1x), xs), _mm_set1_ps(row1));
+                       __m128 w2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(e2x), xs), _mm_set1_ps(row2));
+                       
+                       __m128 zero = _mm_setzero_ps();
+                       __m128 inside = _mm_and_ps(_mm_cmpge_ps(w0, zero), _mm_and_ps(_mm_cmpge_ps(w1, zero), _mm_cmpge_ps(w2, zero)));
+                       if (_mm_movemask_ps(inside) == 0) continue;
+                       
+                       __m128 z = _mm_add_ps(_mm_set1_ps(rowDepth), _mm_mul_ps(_mm_set1_ps(dzdx), _mm_sub_ps(xs, _mm_set1_ps(a.x))));
+                       __m128 old = _mm_loadu_ps(row + x);
+                       __m128 nearer = _mm_min_ps(old, z);
+                       _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, old)));
+                       continue;
+                   }
+#endif
+                   for (int i = 0; i < 4; i++) {
+                       float sx = x + i;
+                       float w0 = e0x * sx + row0;
+                       float w1 = e1x * sx + row1;
+                       float w2 = e2x * sx + row2;
+                       if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) continue;
+                       
+                       float z = rowDepth + dzdx * (sx - a.x);
+                       row[x + i] = std::min(row[x + i], z);
+                   }
+               }
+           }
+       }
+       
+       // Texels with all four corners covered take the farthest of their depths, which bounds
+       // the occluder's depth over the whole texel
+       void resolve_corners() {
+           std::vector<float> &depth = levels[0];
+           int x2 = std::min(touchedX2, width);
+           for (int y = touchedY1; y < touchedY2; y++) {
+               const float *top = &corners[y * cornerStride];
+               const float *bottom = &corners[(y + 1) * cornerStride];
+               float *row = &depth[y * width];
+               
+               int x = touchedX1;
+#if defined(__SSE2__)
+               for (; vectorized && x + 4 <= x2; x += 4) {
+                   __m128 farthest = _mm_max_ps(_mm_max_ps(_mm_loadu_ps(top + x), _mm_loadu_ps(top + x + 1)),
+                                                _mm_max_ps(_mm_loadu_ps(bottom + x), _mm_loadu_ps(bottom + x + 1)));
+                   __m128 covered = _mm_cmple_ps(farthest, _mm_set1_ps(1.0f));
+                   __m128 old = _mm_loadu_ps(row + x);
+                   __m128 nearer = _mm_min_ps(old, farthest);
+                   _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(covered, nearer), _mm_andnot_ps(covered, old)));
+               }
+#endif
+               for (; x < x2; x++) {
+                   float farthest = std::max(std::max(top[x], top[x + 1]), std::max(bottom[x], bottom[x + 1]));
+                   if (farthest <= 1.0f) row[x] = std::min(row[x], farthest);
+               }
+           }
+       }
+       
+       // Each destination texel keeps the farthest of the 2x2 source texels
+       void reduce(const std::vector<float> &source, int sourceWidth, std::vector<float> &destination, int destinationWidth, int destinationHeight) {
+           for (int y = 0; y < destinationHeight; y++) {
+               const float *top = &source[(y * 2) * sourceWidth];
+               const float *bottom = &source[(y * 2 + 1) * sourceWidth];
+               float *row = &destination[y * destinationWidth];
+               
+               int x = 0;
+#if defined(__SSE2__)
+               for (; vectorized && x + 4 <= destinationWidth; x += 4) {
+                   __m128 first = _mm_max_ps(_mm_loadu_ps(top + x * 2), _mm_loadu_ps(bottom + x * 2));
+                   __m128 second = _mm_max_ps(_mm_loadu_ps(top + x * 2 + 4), _mm_loadu_ps(bottom + x * 2 + 4));
+                   __m128 even = _mm_shuffle_ps(first, second, _MM_SHUFFLE(2, 0, 2, 0));
+                   __m128 odd = _mm_shuffle_ps(first, second, _MM_SHUFFLE(3, 1, 3, 1));
+                   _mm_storeu_ps(row + x, _mm_max_ps(even, odd));
+               }
+#endif
+               for (; x < destinationWidth; x++) {
+                   row[x] = std::max(std::max(top[x * 2], top[x * 2 + 1]), std::max(bottom[x * 2], bottom[x * 2 + 1]));
+               }
+           }
+       }
+    private:
+       Mat4x4 combined;
+       std::vector<std::vector<float>> levels;
+       std::vector<Vec2i> levelSizes;
+       std::vector<ScreenPoint> projected;
+       
+       // Nearest depth of the current occluder at each texel corner. Rows are padded so four
+       // corners can always be read at once.
+       static const int cornerStride = width + 4;
+       static constexpr float uncovered = 2.0f;
+       std::vector<float> corners;
+       int touchedX1, touchedY1, touchedX2, touchedY2;
+       
+       bool vectorized = true;
+};
+
+// A point light, placed wherever the object carrying it is
+struct Light {
+     // Components over 1 make the light brighter
+     Vec3f color;
+     
+     // Distance at which the light has faded out completely
+     float radius;
+     
+     Light() : Light(Vec3f(1.0f, 1.0f, 1.0f), 5.0f) {}
+     Light(Vec3f color, float radius) : color(color), radius(radius) {}
+};
+
+// Clustered forward shading. The view frustum is cut into tiles on screen and slices in depth,
+// which get exponentially thicker away from the camera. Every frame the lights are binned into
+// the clusters their spheres touch, and each fragment only shades the lights of its own cluster,
+// so many small lights cost about as much as a few. Three textures hold the bins:
+//   clusters      RG32UI, one texel per cluster: where its lights start in the index list, and how many
+//   lightIndices  R32UI, the index list, 'indexRowLength' texels per row
+//   lights        RGBA32F, two texels per light: position and radius, then color
+class LightClusters {
+    public:
+       static const int tilesX = 16, tilesY = 9, slices = 24;
+       static const int maxLights = 1024;
+       static const int indexRowLength = 1024, indexRows = 64;
+       
+       // Unit 0 is left to the batches and the UI
+       static const int clusterUnit = 1, indexUnit = 2, lightUnit = 3;
+       
+       LightClusters() {
+           clusterTexture = create_texture(clusterUnit, GL_RG32UI, tilesX * tilesY, slices, GL_RG_INTEGER, GL_UNSIGNED_INT);
+           indexTexture = create_texture(indexUnit, GL_R32UI, indexRowLength, indexRows, GL_RED_INTEGER, GL_UNSIGNED_INT);
+           lightTexture = create_texture(lightUnit, GL_RGBA32F, 2, maxLights, GL_RGBA, GL_FLOAT);
+       }
+       
+       void clear() {
+           positions.clear();
+           lights.clear();
+       }
+       // Lights past 'maxLights' are left out
+       void add(const Vec3f &position, const Light &light) {
+           if (lights.size() >= maxLights) return;
+           
+           positions.push_back(position);
+           lights.push_back(light);
+       }
+       // When off, every cluster lists every light, so each fragment loops over all of them.
+       // Lights that don't reach a fragment add nothing, so the image must not change.
+       LightClusters *set_binned(bool to) {
+           this->binned = to;
+           
+           return this;
+       }
+       
+       // Bins the lights as seen from the camera, which has to be a perspective one, and uploads the bins
+       void upload(Camera *camera) {
+           float near = camera->get_near(), far = camera->get_far();
+           this->near = near;
+           this->sliceScale = slices / logf(far / near);
+           this->tileSize = Vec2f(camera->get_width() / tilesX, camera->get_height() / tilesY);
+           
+           if (binned) {
+               bin(camera);
+           } else {
+               // One list of every light, which all the clusters share
+               clusterData.resize(tilesX * tilesY * slices * 2);
+               for (int c = 0; c < tilesX * tilesY * slices; c++) {
+                   clusterData[c * 2] = 0;
+                   clusterData[c * 2 + 1] = lights.size();
+               }
+               indices.assign((lights.size() + indexRowLength - 1) / indexRowLength * indexRowLength, 0);
+               for (int i = 0; i < (int) lights.size(); i++) indices[i] = i;
+               this->indexCount = lights.size();
+           }
+           
+           lightData.resize(lights.size() * 8);
+           for (int i = 0; i < lights.size(); i++) {
+               const Vec3f &p = positions[i];
+               const Light &light = lights[i];
+               float texels[8] = { p.x, p.y, p.z, light.radius, light.color.x, light.color.y, light.color.z, 0.0f };
+               std::copy(texels, texels + 8, lightData.begin() + i * 8);
+           }
+           
+           GLState::bind_texture(GL_TEXTURE_2D, clusterTexture, clusterUnit);
+           glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, tilesX * tilesY, slices, GL_RG_INTEGER, GL_UNSIGNED_INT, clusterData.data());
+           if (!indices.empty()) {
+               GLState::bind_texture(GL_TEXTURE_2D, indexTexture, indexUnit);
+               glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, indexRowLength, indices.size() / indexRowLength, GL_RED_INTEGER, GL_UNSIGNED_INT, indices.data());
+           }
+           if (!lights.empty()) {
+               GLState::bind_texture(GL_TEXTURE_2D, lightTexture, lightUnit);
+               glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 2, lights.size(), GL_RGBA, GL_FLOAT, lightData.data());
+           }
+       }
+       
+       // Binds the textures and gives the shader what it needs to find a fragment's cluster
+       void bind(Shader *shader) {
+           GLState::bind_texture(GL_TEXTURE_2D, clusterTexture, clusterUnit);
+           GLState::bind_texture(GL_TEXTURE_2D, indexTexture, indexUnit);
+           GLState::bind_texture(GL_TEXTURE_2D, lightTexture, lightUnit);
+           
+           shader->use();
+           shader->set_uniform_int("clusters", clusterUnit);
+           shader->set_uniform_int("lightIndices", indexUnit);
+           shader->set_uniform_int("lights", lightUnit);
+           shader->set_uniform_vec3f("clusterCount", tilesX, tilesY, slices);
+           shader->set_uniform_vec2f("tileSize", tileSize.x, tileSize.y);
+           shader->set_uniform_vec2f("depthSlicing", near, sliceScale);
+       }
+       
+       int get_light_count() { return lights.size(); }
+       int get_index_count() { return this->indexCount; }
+       
+       void dispose() {
+           GLState::delete_texture(clusterTexture);
+           GLState::delete_texture(indexTexture);
+           GLState::delete_texture(lightTexture);
+       }
+    private:
+       struct ClusterRange {
+           int light;
+           
+           // The light's sphere in view space, with depth increasing away from the camera
+           Vec3f center;
+           float radius;
+           
+           // Clusters around the sphere's bounding box, not all of which it touches
+           int x0, x1, y0, y1, z0, z1;
+       };
+       
+       static GLuint create_texture(int unit, GLenum internalFormat, int width, int height, GLenum format, GLenum type) {
+           GLuint texture;
+           glGenTextures(1, &texture);
+           GLState::bind_texture(GL_TEXTURE_2D, texture, unit);
+           glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+           
+           // Integer and float textures can't be filtered
+           glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+           glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+           return texture;
+       }
+       // Sorts the lights into the clusters their spheres touch
+       void bin(Camera *camera) {
+           Mat4x4 view = camera->get_view();
+           const float *v = view.values;
+           
+           float near = camera->get_near(), far = camera->get_far();
+           float tanY = tanf(camera->get_fov() * M_PI / 360.0f);
+           float tanX = tanY * camera->get_width() / camera->get_height();
+           this->tanX = tanX;
+           this->tanY = tanY;
+           
+           // First the range of clusters each light touches, and how many lights land in each cluster
+           counts.assign(tilesX * tilesY * slices, 0);
+           ranges.clear();
+           for (int i = 0; i < lights.size(); i++) {
+               const Vec3f &p = positions[i];
+               float radius = lights[i].radius;
+               float x = v[0] * p.x + v[1] * p.y + v[2] * p.z + v[3];
+               float y = v[4] * p.x + v[5] * p.y + v[6] * p.z + v[7];
+               float depth = -(v[8] * p.x + v[9] * p.y + v[10] * p.z + v[11]);
+               
+               float nearest = std::max(depth - radius, near), furthest = std::min(depth + radius, far);
+               if (furthest < nearest) continue;
+               
+               // The sphere's bounding box spans the widest angle at one of its corners
+               float minX = 1.0f, maxX = -1.0f, minY = 1.0f, maxY = -1.0f;
+               for (float z : { nearest, furthest }) {
+                   for (float side : { -radius, radius }) {
+                       minX = std::min(minX, (x + side) / (z * tanX));
+                       maxX = std::max(maxX, (x + side) / (z * tanX));
+                       minY = std::min(minY, (y + side) / (z * tanY));
+                       maxY = std::max(maxY, (y + side) / (z * tanY));
+                   }
+               }
+               if (maxX < -1.0f || minX > 1.0f || maxY < -1.0f || minY > 1.0f) continue;
+               
+               ClusterRange range;
+               range.light = i;
+               range.center.x = x;
+               range.center.y = y;
+               range.center.z = depth;
+               range.radius = radius;
+               range.x0 = tile_of(minX, tilesX);
+               range.x1 = tile_of(maxX, tilesX);
+               range.y0 = tile_of(minY, tilesY);
+               range.y1 = tile_of(maxY, tilesY);
+               range.z0 = slice_of(nearest);
+               range.z1 = slice_of(furthest);
+               ranges.push_back(range);
+               
+               for_each_cluster(range, [&](int cluster) { counts[cluster]++; });
+           }
+           
+           // Then each cluster's part of the index list, filled in light order
+           clusterData.resize(counts.size() * 2);
+           uint total = 0;
+           for (int c = 0; c < counts.size(); c++) {
+               uint count = std::min(counts[c], (uint) (indexRowLength * indexRows) - total);
+               clusterData[c * 2] = total;
+               clusterData[c * 2 + 1] = count;
+               counts[c] = 0;
+               total += count;
+           }
+           indices.assign((total + indexRowLength - 1) / indexRowLength * indexRowLength, 0);
+           for (auto &range : ranges) {
+               for_each_cluster(range, [&](int cluster) {
+                   uint &filled = counts[cluster];
+                   if (filled < clusterData[cluster * 2 + 1]) {
+                       indices[clusterData[cluster * 2] + filled++] = range.light;
+                   }
+               });
+           }
+           this->indexCount = total;
+       }
+       // From normalized device coordinates
+       static int tile_of(float ndc, int tiles) {
+           return std::min(std::max((int) ((ndc + 1.0f) * 0.5f * tiles), 0), tiles - 1);
+       }
+       int slice_of(float depth) {
+           return std::min(std::max((int) (logf(depth / near) * sliceScale), 0), slices - 1);
+       }
+       // Visits the clusters of the range whose bounding boxes the light's sphere reaches.
+       // The boxes are padded a little, as the shader finds its slice with its own rounding.
+       void for_each_cluster(const ClusterRange &range, const std::function<void(int)> &visit) {
+           const Vec3f &c = range.center;
+           float radiusSquared = range.radius * range.radius;
+           auto gap = [](float value, float low, float high) {
+               return value < low ? low - value : (value > high ? value - high : 0.0f);
+           };
+           
+           for (int z = range.z0; z <= range.z1; z++) {
+               float d0 = near * expf(z / sliceScale) * 0.999f;
+               float d1 = near * expf((z + 1) / sliceScale) * 1.001f;
+               float gapZ = gap(c.z, d0, d1);
+               
+               for (int y = range.y0; y <= range.y1; y++) {
+                   float y0 = (y * 2.0f / tilesY - 1.0f) * tanY, y1 = ((y + 1) * 2.0f / tilesY - 1.0f) * tanY;
+                   float gapY = gap(c.y, std::min(y0 * d0, y0 * d1), std::max(y1 * d0, y1 * d1));
+                   
+                   for (int x = range.x0; x <= range.x1; x++) {
+                       float x0 = (x * 2.0f / tilesX - 1.0f) * tanX, x1 = ((x + 1) * 2.0f / tilesX - 1.0f) * tanX;
+                       float gapX = gap(c.x, std::min(x0 * d0, x0 * d1), std::max(x1 * d0, x1 * d1));
+                       
+                       if (gapX * gapX + gapY * gapY + gapZ * gapZ <= radiusSquared) {
+                           visit((z * tilesY + y) * tilesX + x);
+                       }
+                   }
+               }
+           }
+       }
+       
+       GLuint clusterTexture, indexTexture, lightTexture;
+       bool binned = true;
+       
+       std::vector<Vec3f> positions;
+       std::vector<Light> lights;
+       
+       std::vector<ClusterRange> ranges;
+       std::vector<uint> counts, clusterData, indices;
+       std::vector<float> lightData;
+       int indexCount = 0;
+       
+       float near = 0.1f, sliceScale = 1.0f;
+       float tanX = 1.0f, tanY = 1.0f;
+       Vec2f tileSize;
+};
+
+class SceneObject;
+struct TriangleHit {
+     SceneObject *object = nullptr;
+     int triangle = -1;
+     float distance = 0.0f;
+     
+     // Barycentric coordinates of the hit point relative to the triangle's 2nd and 3rd vertices
+     float u = 0.0f, v = 0.0f;
+};
+
+// Per-object data for instanced draws: the transform (scaling, then translation) and a color
+// multiplied with the vertex colors
+struct InstanceData {
+    Vec3f Position;
+    Vec3f Scaling;
+    Vec3f Color;
+    
+    InstanceData() {}
+    InstanceData(Vec3f position, Vec3f scaling, Vec3f color) : Position(position), Scaling(scaling), Color(color) {}
+};
+using InstanceDatas = std::vector<InstanceData>;
+
+// A mesh's vertices and indices in GPU memory, uploaded once and drawn instanced.
+// The attributes sit at fixed locations, so any shader declaring them with the same layout can draw it.
+class MeshBuffer {
+    public:
+       ~MeshBuffer() {
+           dispose();
+       }
+       
+       // Compact vertices are quantized inside 'bounds', which should hold every vertex
+       void upload(const RenderVertices &vertices, const RenderIndices &indices, VertexFormats format = VertexFormats::full, const AABB &bounds = AABB()) {
+           dispose();
+           this->format = format;
+           
+           glGenVertexArrays(1, &this->vao);
+           GLState::bind_vertex_array(this->vao);
+           
+           glGenBuffers(1, &this->vbo);
+           glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
+           if (format == VertexFormats::compact) {
+               this->origin = bounds.min;
+               this->extent = Vec3f(bounds.max).sub(bounds.min);
+               
+               // A flat axis has every vertex at the origin, whatever the extent
+               if (extent.x <= 0.0f) extent.x = 1.0f;
+               if (extent.y <= 0.0f) extent.y = 1.0f;
+               if (extent.z <= 0.0f) extent.z = 1.0f;
+               
+               CompactVertices packed;
+               packed.reserve(vertices.size());
+               for (auto &vertex : vertices) {
+                   packed.push_back(CompactVertex(vertex, origin, extent));
+               }
+               glBufferData(GL_ARRAY_BUFFER, packed.size() * sizeof(CompactVertex), packed.data(), GL_STATIC_DRAW);
+           } else {
+               glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(RenderVertex), vertices.data(), GL_STATIC_DRAW);
+           }
+           this->vertexBytes = vertices.size() * VertexAttributes::stride(format);
+           
+           glGenBuffers(1, &this->ebo);
+           glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, this->ebo);
+           glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint), indices.data(), GL_STATIC_DRAW);
+           
+           VertexAttributes::setup(format);
+           
+           // The instance attributes advance once per instance. Their source is set on every draw.
+           GLuint instanceLocations[] = { VertexAttributes::instancePosition, VertexAttributes::instanceScaling, VertexAttributes::instanceColor };
+           for (auto &location : instanceLocations) {
+               glEnableVertexAttribArray(location);
+               glVertexAttribDivisor(location, 1);
+           }
+           
+           // The element buffer binding is kept by the vertex array
+           GLState::bind_vertex_array(0);
+           glBindBuffer(GL_ARRAY_BUFFER, 0);
+           glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+           
+           this->indexCount = indices.size();
+       }
+       
+       // Draws 'count' instances whose data starts 'offset' bytes into the instance buffer
+       void draw(GLuint instances, int offset, int count) {
+           if (this->indexCount == 0 || count == 0) {
+               return;
+           }
+           GLState::bind_vertex_array(this->vao);
+           glBindBuffer(GL_ARRAY_BUFFER, instances);
+           glVertexAttribPointer(VertexAttributes::instancePosition, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*) (offset + offsetof(InstanceData, Position)));
+           glVertexAttribPointer(VertexAttributes::instanceScaling, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*) (offset + offsetof(InstanceData, Scaling)));
+           glVertexAttribPointer(VertexAttributes::instanceColor, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*) (offset + offsetof(InstanceData, Color)));
+           
+           glDrawElementsInstanced(GL_TRIANGLES, this->indexCount, GL_UNSIGNED_INT, 0, count);
+           glBindBuffer(GL_ARRAY_BUFFER, 0);
+       }
+       
+       // The instance that places the mesh at 'position' with 'scaling'. Compact meshes fold
+       // their dequantization into it: local = origin + quantized * extent.
+       InstanceData instance_of(const Vec3f &position, const Vec3f &scaling, const Vec3f &color) {
+           if (this->format != VertexFormats::compact) {
+               return InstanceData(position, scaling, color);
+           }
+           Vec3f placed = Vec3f(origin).mul(scaling).add(position);
+           return InstanceData(placed, Vec3f(extent).mul(scaling), color);
+       }
+       
+       bool is_uploaded() { return this->vao != 0; }
+       GLuint get_vertex_array() { return this->vao; }
+       VertexFormats get_format() { return this->format; }
+       int get_vertex_bytes() { return this->vertexBytes; }
+       
+       void dispose() {
+           if (this->vbo) {
+               glDeleteBuffers(1, &this->vbo);
+           }
+           if (this->ebo) {
+               glDeleteBuffers(1, &this->ebo);
+           }
+           if (this->vao) {
+               GLState::delete_vertex_array(this->vao);
+           }
+           this->vao = this->vbo = this->ebo = 0;
+           this->indexCount = this->vertexBytes = 0;
+       }
+    private:
+       GLuint vao = 0, vbo = 0, ebo = 0;
+       int indexCount = 0, vertexBytes = 0;
+       
+       VertexFormats format = VertexFormats::full;
+       Vec3f origin, extent;
+};
+
+// Passes draw in this order. Outlines lie exactly on the objects' faces, so they go before
+// the objects to win the depth test.
+enum class RenderPasses {
+     grid,
+     axes,
+     outlines,
+     opaque,
+     overlay
+};
+
+// Collects a frame's draws in any order and sorts them by a 64-bit key:
+//   pass 8 | shader 8 | texture 8 | mesh 16 | depth 24
+// so that each program and texture is bound once per pass. Neighbouring instances of the same
+// mesh merge into one instanced draw, nearest first so early depth testing can skip the rest.
+class RenderQueue {
+    public:
+       RenderQueue() {
+           glGenBuffers(1, &this->vbo);
+       }
+       
+       static uint64_t make_key(RenderPasses pass, GLuint shader, GLuint texture, GLuint mesh, float depth) {
+           uint64_t quantized = (uint64_t) (std::min(std::max(depth, 0.0f), 1.0f) * 0xFFFFFF);
+           return ((uint64_t) pass << 56) |
+                  ((uint64_t) (shader & 0xFF) << 48) |
+                  ((uint64_t) (texture & 0xFF) << 40) |
+                  ((uint64_t) (mesh & 0xFFFF) << 24) |
+                  quantized;
+       }
+       
+       // An instance of a mesh. 'depth' is the distance from the camera as a fraction of the far plane.
+       void submit(RenderPasses pass, Shader *shader, MeshBuffer *mesh, const InstanceData &instance, float depth) {
+           keys.push_back(std::make_pair(make_key(pass, shader->get_program(), 0, mesh->get_vertex_array(), depth), (int) instances.size()));
+           instances.push_back(InstanceItem(shader, mesh, instance));
+       }
+       // An instance submitted from one of 'count' threads running at once, into the thread's own
+       // staging region. The regions join the rest in worker order when rendering.
+       void submit(int worker, RenderPasses pass, Shader *shader, MeshBuffer *mesh, const InstanceData &instance, float depth) {
+           regions[worker].push_back(std::make_pair(make_key(pass, shader->get_program(), 0, mesh->get_vertex_array(), depth), InstanceItem(shader, mesh, instance)));
+       }
+       // Must be called on the GL thread before workers submit
+       void prepare_regions(int count) {
+           if (regions.size() < count) regions.resize(count);
+       }
+       // Anything else; 'draw' runs with the shader in use, in submission order within its pass
+       void submit(RenderPasses pass, Shader *shader, GLuint texture, std::function<void()> draw) {
+           keys.push_back(std::make_pair(make_key(pass, shader->get_program(), texture, 0, 0.0f), -(int) callbacks.size() - 1));
+           callbacks.push_back(CallbackItem(shader, draw));
+       }
+       
+       void render() {
+           if (timed) Timing::begin("upload");
+           
+           for (auto &region : regions) {
+               for (auto &item : region) {
+                   keys.push_back(std::make_pair(item.first, (int) instances.size()));
+                   instances.push_back(item.second);
+               }
+               region.clear();
+           }
+           
+           // Ties keep submission order, as only the keys are compared
+           std::stable_sort(keys.begin(), keys.end(), [](const std::pair<uint64_t, int> &a, const std::pair<uint64_t, int> &b) {
+               return a.first < b.first;
+           });
+           
+           // All instances go up in sorted order with one upload, so that every merged run is contiguous
+           staging.clear();
+           for (auto &key : keys) {
+               if (key.second >= 0) staging.push_back(instances[key.second].instance);
+           }
+           if (!staging.empty()) {
+               // Orphans last frame's storage instead of waiting for draws still reading it
+               glBindBuffer(GL_ARRAY_BUFFER, this->vbo);
+               glBufferData(GL_ARRAY_BUFFER, staging.size() * sizeof(InstanceData), &staging[0], GL_STREAM_DRAW);
+               glBindBuffer(GL_ARRAY_BUFFER, 0);
+               StreamBuffer::bytes_this_frame() += staging.size() * sizeof(InstanceData);
+           }
+           if (timed) Timing::end();
+           
+           this->drawCalls = this->shaderChanges = 0;
+           Shader *current = nullptr;
+           int first = 0, pass = -1;
+           for (int i = 0; i < keys.size();) {
+               int index = keys[i].second;
+               if (timed && (int) (keys[i].first >> 56) != pass) {
+                   if (pass >= 0) Timing::end();
+                   pass = keys[i].first >> 56;
+                   Timing::begin(passNames[pass], true);
+               }
+               Shader *shader = index >= 0 ? instances[index].shader : callbacks[-index - 1].shader;
+               if (shader != current) {
+                   shader->use();
+                   current = shader;
+                   this->shaderChanges++;
+               }
+               
+               if (index < 0) {
+                   callbacks[-index - 1].draw();
+                   this->drawCalls++;
+                   i++;
+                   continue;
+               }
+               
+               // Extends the run while only the depth differs
+               MeshBuffer *mesh = instances[index].mesh;
+               uint64_t group = keys[i].first >> 24;
+               int count = 0;
+               while (i < keys.size() && keys[i].second >= 0 && (keys[i].first >> 24) == group &&
+                      instances[keys[i].second].mesh == mesh && instances[keys[i].second].shader == shader) {
+                   count++;
+                   i++;
+               }
+               mesh->draw(this->vbo, first * sizeof(InstanceData), count);
+               first += count;
+               this->drawCalls++;
+           }
+           if (timed && pass >= 0) Timing::end();
+           
+           keys.clear();
+           instances.clear();
+           callbacks.clear();
+       }
+       
+       int get_draw_calls() { return this->drawCalls; }
+       int get_shader_changes() { return this->shaderChanges; }
+       
+       // Times the upload and every pass, on the CPU and the GPU
+       RenderQueue *set_timed(bool to) {
+           this->timed = to;
+           
+           return this;
+       }
+       
+       void dispose() {
+           if (this->vbo) {
+               glDeleteBuffers(1, &this->vbo);
+           }
+           this->vbo = 0;
+       }
+    private:
+       struct InstanceItem {
+           Shader *shader;
+           MeshBuffer *mesh;
+           InstanceData instance;
+           InstanceItem(Shader *shader, MeshBuffer *mesh, const InstanceData &instance) : shader(shader), mesh(mesh), instance(instance) {}
+       };
+       struct CallbackItem {
+           Shader *shader;
+           std::function<void()> draw;
+           CallbackItem(Shader *shader, std::function<void()> draw) : shader(shader), draw(draw) {}
+       };
+       
+       // Instances are referred to by their index, callbacks by -(index + 1)
+       std::vector<std::pair<uint64_t, int>> keys;
+       std::vector<InstanceItem> instances;
+       std::vector<CallbackItem> callbacks;
+       std::vector<std::vector<std::pair<uint64_t, InstanceItem>>> regions;
+       InstanceDatas staging;
+       int drawCalls = 0, shaderChanges = 0;
+       
+       bool timed = false;
+       const char *passNames[5] = { "grid", "axes", "outlines", "opaque", "overlay" };
+       
+       GLuint vbo;
+};
+
+// Mesh simplification by vertex clustering: the vertices inside each cell of a uniform grid
+// merge into one, and the triangles left with fewer than three corners go away. It runs in
+// linear time, which big imported scans need, and moves no vertex further than a cell's diagonal.
+namespace Simplifier {
+     struct Cluster {
+          Vec3f position = Vec3f(0.0f, 0.0f, 0.0f), color = Vec3f(0.0f, 0.0f, 0.0f), normal = Vec3f(0.0f, 0.0f, 0.0f);
+          int count = 0;
+     };
+     
+     // 'resolution' cells go along the longest side of 'bounds'. Vertices facing different ways
+     // get their own clusters, so hard edges and thin walls keep their shading.
+     void cluster(const RenderVertices &vertices, const RenderIndices &indices, const AABB &bounds, int resolution,
+                  RenderVertices &resultVertices, RenderIndices &resultIndices) {
+          Vec3f size = Vec3f(bounds.max).sub(bounds.min);
+          float cellSize = std::max(std::max(size.x, size.y), std::max(size.z, 1e-6f)) / resolution;
+          
+          // 20 bits per cell coordinate, 3 for the dominant normal direction
+          auto key_of = [&](const RenderVertex &vertex) {
+               uint64_t x = (uint64_t) ((vertex.Position.x - bounds.min.x) / cellSize);
+               uint64_t y = (uint64_t) ((vertex.Position.y - bounds.min.y) / cellSize);
+               uint64_t z = (uint64_t) ((vertex.Position.z - bounds.min.z) / cellSize);
+               
+               const Vec3f &n = vertex.Normal;
+               float ax = fabs(n.x), ay = fabs(n.y), az = fabs(n.z);
+               uint64_t axis = (ax >= ay && ax >= az) ? 0 : (ay >= az ? 1 : 2);
+               float component = axis == 0 ? n.x : (axis == 1 ? n.y : n.z);
+               uint64_t direction = axis * 2 + (component < 0.0f ? 1 : 0);
+               
+               return (std::min(x, (uint64_t) 0xFFFFF) << 43) | (std::min(y, (uint64_t) 0xFFFFF) << 23) | (std::min(z, (uint64_t) 0xFFFFF) << 3) | direction;
+          };
+          
+          std::unordered_map<uint64_t, uint> clusterOf;
+          std::vector<Cluster> clusters;
+          std::vector<uint> remap(vertices.size(), UINT_MAX);
+          for (auto &index : indices) {
+               if (remap[index] != UINT_MAX) continue;
+               
+               const RenderVertex &vertex = vertices[index];
+               auto found = clusterOf.emplace(key_of(vertex), (uint) clusters.size());
+               if (found.second) clusters.push_back(Cluster());
+               
+               Cluster &cluster = clusters[found.first->second];
+               cluster.position.add(vertex.Position);
+               cluster.color.add(vertex.Color);
+               cluster.normal.add(vertex.Normal);
+               cluster.count++;
+               remap[index] = found.first->second;
+          }
+          
+          resultVertices.clear();
+          resultVertices.reserve(clusters.size());
+          for (auto &cluster : clusters) {
+               float inverse = 1.0f / cluster.count;
+               Vec3f normal = cluster.normal;
+               if (normal.len() > 1e-6f) normal = normal.norm();
+               resultVertices.push_back(RenderVertex(cluster.position.mul(inverse), cluster.color.mul(inverse), normal));
+          }
+          
+          resultIndices.clear();
+          for (int i = 0; i + 2 < indices.size(); i += 3) {
+               uint a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+               if (a == b || b == c || a == c) continue;
+               resultIndices.insert(resultIndices.end(), { a, b, c });
+          }
+     }
+};
+
+// A simplified copy of a mesh. 'error' bounds how far its vertices moved, as a fraction of the
+// mesh's longest side.
+struct DetailLevel {
+     RenderVertices renderVertices;
+     RenderIndices indices;
+     float error;
+};
+using DetailLevels = std::vector<DetailLevel>;
+using DetailBuffers = std::vector<std::shared_ptr<MeshBuffer>>;
+
+struct Mesh {
+     // Coarser levels are kept only when they have at most this fraction of the triangles of the previous one
+     static constexpr float detailReduction = 0.5f;
+     static const int minDetailTriangles = 64;
+     
+     RenderVertices renderVertices;
+     RenderIndices indices;
+     Mesh() {}
+     Mesh(RenderVertices vertices, RenderIndices indices) : renderVertices(vertices), indices(indices) {}
+     
+     Mesh set_color(const Vec3f color) {
+          for (auto &vertex : renderVertices) {
+               vertex.Color = color;
+          }
+          buffer = std::make_shared<MeshBuffer>();
+          detailLevels.reset();
+          
+          return *this;
+     }
+     Mesh set_color(float r, float g, float b) {
+          return set_color(Vec3f(r, g, b));
+     }
+     // How the GPU copy stores the vertices. The CPU copy keeps full precision for picking and export.
+     Mesh set_vertex_format(VertexFormats format) {
+          this->format = format;
+          buffer = std::make_shared<MeshBuffer>();
+          if (detailLevels != nullptr) {
+               detailBuffers = make_detail_buffers(detailLevels->size());
+          }
+          
+          return *this;
+     }
+     // Generates up to 'count' levels of detail, the first being the mesh itself. Meshes too
+     // small to simplify keep fewer. Copies of the mesh share the levels.
+     Mesh set_detail_levels(int count) {
+          this->detailCount = count;
+          detailLevels.reset();
+          get_detail_levels();
+          
+          return *this;
+     }
+     uint max_index() {
+          uint result = 0;
+          for (auto &index : indices) {
+               if (index > result) result = index;
+          }
+          
+          return result;
+     }
+     int triangle_count() {
+          return indices.size() / 3;
+     }
+     int triangle_count(int level) {
+          return level == 0 ? triangle_count() : get_detail_levels()[level - 1].indices.size() / 3;
+     }
+     
+     // Must be called after editing vertex positions or indices of an existing mesh
+     void invalidate() {
+          triangleTree.reset();
+          buffer = std::make_shared<MeshBuffer>();
+          detailLevels.reset();
+          boundsComputed = false;
+     }
+     
+     // The simplified levels, coarsest last. They are regenerated on use after the mesh changed.
+     DetailLevels &get_detail_levels() {
+          if (detailLevels == nullptr) {
+               detailLevels = std::make_shared<DetailLevels>();
+               
+               // Start from cells about as large as a quarter of the mesh's triangles, then halve the resolution
+               int resolution = std::min((int) sqrtf(triangle_count()) / 4, 0xFFFFF);
+               int previous = triangle_count();
+               float error = 0.0f;
+               const RenderVertices *sourceVertices = &renderVertices;
+               const RenderIndices *sourceIndices = &indices;
+               while (detailLevels->size() + 1 < detailCount && resolution >= 2 && previous > minDetailTriangles) {
+                    DetailLevel level;
+                    Simplifier::cluster(*sourceVertices, *sourceIndices, get_bounds(), resolution, level.renderVertices, level.indices);
+                    // A vertex may end up anywhere in its cell, up to the diagonal away
+                    level.error = error + sqrtf(3.0f) / resolution;
+                    resolution /= 2;
+                    
+                    int triangles = level.indices.size() / 3;
+                    if (triangles == 0 || triangles > previous * detailReduction) continue;
+                    
+                    // Clustering the previous level again is cheaper than going back to the full mesh
+                    previous = triangles;
+                    error = level.error;
+                    detailLevels->push_back(level);
+                    sourceVertices = &detailLevels->back().renderVertices;
+                    sourceIndices = &detailLevels->back().indices;
+               }
+               detailBuffers = make_detail_buffers(detailLevels->size());
+          }
+          return *detailLevels;
+     }
+     int detail_level_count() {
+          return detailCount > 1 ? get_detail_levels().size() + 1 : 1;
+     }
+     // How far vertices of a level may have moved, as a fraction of the mesh's longest side
+     float detail_error(int level) {
+          return level == 0 ? 0.0f : get_detail_levels()[level - 1].error;
+     }
+     
+     // The GPU copy of a level, uploaded or not. Unlike get_buffer, it makes no GL calls, so
+     // other threads can use it as long as the GL thread waits for them.
+     MeshBuffer *find_buffer(int level = 0) {
+          return level == 0 ? buffer.get() : detailBuffers->at(level - 1).get();
+     }
+     // The GPU copy of a level, uploaded on first use and shared by copies of the mesh
+     MeshBuffer *get_buffer(int level = 0) {
+          if (level > 0) {
+               DetailLevel &detail = get_detail_levels()[level - 1];
+               MeshBuffer *levelBuffer = detailBuffers->at(level - 1).get();
+               
+               // Clustered vertices stay inside the full mesh's bounds, so those quantize them too
+               if (!levelBuffer->is_uploaded()) {
+                    levelBuffer->upload(detail.renderVertices, detail.indices, format, get_bounds());
+               }
+               return levelBuffer;
+          }
+          if (!buffer->is_uploaded()) {
+               buffer->upload(renderVertices, indices, format, get_bounds());
+          }
+          return buffer.get();
+     }
+     // Frees the GPU copies, which get uploaded again if the mesh is drawn later
+     void dispose() {
+          buffer->dispose();
+          for (auto &levelBuffer : *detailBuffers) {
+               levelBuffer->dispose();
+          }
+     }
+     
+     // Local-space bounds of the indexed vertices, computed once
+     AABB &get_bounds() {
+          if (!boundsComputed) {
+               if (indices.empty()) {
+                    bounds = AABB(Vec3f(0.0f, 0.0f, 0.0f), Vec3f(0.0f, 0.0f, 0.0f));
+               } else {
+                    bounds = AABB(renderVertices.at(indices[0]).Position, renderVertices.at(indices[0]).Position);
+                    for (auto &index : indices) {
+                         bounds.merge(renderVertices.at(index).Position);
+                    }
+               }
+               boundsComputed = true;
+          }
+          return bounds;
+     }
+     
+     // Built on first use; copies of the mesh share it
+     BVH &get_triangle_tree() {
+          if (triangleTree == nullptr) {
+               std::vector<AABB> bounds;
+               bounds.reserve(triangle_count());
+               for (int i = 0; i < triangle_count(); i++) {
+                    AABB box = AABB(renderVertices.at(indices[i * 3]).Position, renderVertices.at(indices[i * 3]).Position);
+                    box.merge(renderVertices.at(indices[i * 3 + 1]).Position);
+                    box.merge(renderVertices.at(indices[i * 3 + 2]).Position);
+                    bounds.push_back(box);
+               }
+               triangleTree = std::make_shared<BVH>();
+               triangleTree->build(bounds);
+          }
+          return *triangleTree;
+     }
+     
+     // Möller-Trumbore test against one triangle, in the mesh's local space
+     bool intersect_triangle(int triangle, const Vec3f &origin, const Vec3f &direction, float maxLength, TriangleHit &hit) {
+          const Vec3f &a = renderVertices[indices[triangle * 3 + 0]].Position;
+          const Vec3f &b = renderVertices[indices[triangle * 3 + 1]].Position;
+          const Vec3f &c = renderVertices[indices[triangle * 3 + 2]].Position;
+          
+          float e1x = b.x - a.x, e1y = b.y - a.y, e1z = b.z - a.z;
+          float e2x = c.x - a.x, e2y = c.y - a.y, e2z = c.z - a.z;
+          
+          // p = direction x e2
+          float px = direction.y * e2z - direction.z * e2y;
+          float py = direction.z * e2x - direction.x * e2z;
+          float pz = direction.x * e2y - direction.y * e2x;
+          float determinant = e1x * px + e1y * py + e1z * pz;
+          if (fabs(determinant) < 1e-12f) return false;
+          float inverse = 1.0f / determinant;
+          
+          float tx = origin.x - a.x, ty = origin.y - a.y, tz = origin.z - a.z;
+          float u = (tx * px + ty * py + tz * pz) * inverse;
+          if (u < 0.0f || u > 1.0f) return false;
+          
+          // q = t x e1
+          float qx = ty * e1z - tz * e1y;
+          float qy = tz * e1x - tx * e1z;
+          float qz = tx * e1y - ty * e1x;
+          float v = (direction.x * qx + direction.y * qy + direction.z * qz) * inverse;
+          if (v < 0.0f || u + v > 1.0f) return false;
+          
+          float distance = (e2x * qx + e2y * qy + e2z * qz) * inverse;
+          if (distance < 0.0f || distance > maxLength) return false;
+          
+          hit.triangle = triangle;
+          hit.distance = distance;
+          hit.u = u;
+          hit.v = v;
+          return true;
+     }
+     
+     // Nearest triangle hit by the ray in local space, searched through the triangle hierarchy
+     bool intersect_ray(const Vec3f &origin, const Vec3f &direction, float maxLength, TriangleHit &hit) {
+          if (indices.size() < 3) return false;
+          
+          bool found = false;
+          get_triangle_tree().traverse_ray(origin, direction, maxLength, [&](int triangle, float &maxLength) {
+               if (intersect_triangle(triangle, origin, direction, maxLength, hit)) {
+                    maxLength = hit.distance;
+                    found = true;
+               }
+          });
+          return found;
+     }
+     
+     // Packet version of intersect_ray in local space. Rays that hit a triangle nearer than their length
+     // get it recorded in the packet; returns the mask of those rays.
+     int intersect_packet(RayPacket &packet) {
+          if (indices.size() < 3) return 0;
+          
+          int updated = 0;
+          get_triangle_tree().traverse_packet(packet, [&](int triangle) {
+               const Vec3f &a = renderVertices[indices[triangle * 3 + 0]].Position;
+               const Vec3f &b = renderVertices[indices[triangle * 3 + 1]].Position;
+               const Vec3f &c = renderVertices[indices[triangle * 3 + 2]].Position;
+               updated |= PacketKernels::intersect_triangle(packet, a, b, c, triangle);
+          });
+          return updated;
+     }
+     
+     private:
+        std::shared_ptr<MeshBuffer> buffer = std::make_shared<MeshBuffer>();
+        VertexFormats format = VertexFormats::full;
+        std::shared_ptr<BVH> triangleTree;
+        
+        int detailCount = 1;
+        std::shared_ptr<DetailLevels> detailLevels;
+        std::shared_ptr<DetailBuffers> detailBuffers = std::make_shared<DetailBuffers>();
+        
+        // One GPU copy per simplified level
+        static std::shared_ptr<DetailBuffers> make_detail_buffers(int count) {
+             std::shared_ptr<DetailBuffers> buffers = std::make_shared<DetailBuffers>();
+             for (int i = 0; i < count; i++) {
+                  buffers->push_back(std::make_shared<MeshBuffer>());
+             }
+             return buffers;
+        }
+        AABB bounds;
+        bool boundsComputed = false;
+};
+
+// A batched object
+class SceneObject {
+     public:
+        Vec3f position, scaling;
+        
+        // Multiplied with the mesh's vertex colors, so objects sharing a mesh can still differ
+        Vec3f color;
+        
+        // A level switches to a coarser one once its error is under this fraction of the allowed error
+        static constexpr float detailHysteresis = 0.7f;
+        
+        SceneObject(Mesh mesh) {
+             this->mesh = mesh;
+             this->sceneIndex = -1;
+             
+             position = Vec3f(0.0f, 0.0f, 0.0f);
+             scaling = Vec3f(1.0f, 1.0f, 1.0f);
+             color = Vec3f(1.0f, 1.0f, 1.0f);
+             boundsDirty = true;
+        }
+        
+        // Queues the object as one instance of its mesh
+        void render(RenderQueue *queue, Shader *shader, float depth) {
+             render(queue, shader, depth, this->color);
+        }
+        // Renders with the vertex colors multiplied by another color
+        void render(RenderQueue *queue, Shader *shader, float depth, const Vec3f &color) {
+             if (mesh.indices.empty()) return;
+             
+             MeshBuffer *buffer = mesh.get_buffer(this->detailLevel);
+             queue->submit(RenderPasses::opaque, shader, buffer, buffer->instance_of(this->position, this->scaling, color), depth);
+        }
+        // render() for worker threads, which submit into their region of the queue. Returns false
+        // if the mesh still has to be uploaded, which is left to render() on the GL thread.
+        bool prepare(RenderQueue *queue, int worker, Shader *shader, float depth, const Vec3f &color) {
+             if (mesh.indices.empty()) return true;
+             
+             MeshBuffer *buffer = mesh.find_buffer(this->detailLevel);
+             if (!buffer->is_uploaded()) return false;
+             
+             queue->submit(worker, RenderPasses::opaque, shader, buffer, buffer->instance_of(this->position, this->scaling, color), depth);
+             return true;
+        }
+        Mesh &get_mesh() { return this->mesh; }
+        
+        // Picks the coarsest level of detail whose vertices move less than 'maxError' pixels on
+        // screen. An object near a threshold keeps its level until it is well past it.
+        void select_detail(Camera *camera, float maxError) {
+             int levels = mesh.detail_level_count();
+             this->detailLevel = std::min(this->detailLevel, levels - 1);
+             if (levels == 1) return;
+             
+             AABB &box = get_bounding_box();
+             Vec3f size = Vec3f(box.max).sub(box.min);
+             float longest = std::max(std::max(size.x, size.y), size.z);
+             float distance = Vec3f(box.center()).sub(camera->position).len() - size.len() * 0.5f;
+             float pixels = camera->projected_size(longest, distance);
+             
+             while (detailLevel > 0 && mesh.detail_error(detailLevel) * pixels > maxError) {
+                  detailLevel--;
+             }
+             while (detailLevel + 1 < levels && mesh.detail_error(detailLevel + 1) * pixels < maxError * detailHysteresis) {
+                  detailLevel++;
+             }
+        }
+        int get_detail_level() { return this->detailLevel; }
+        
+        // World-space bounds, recomputed from the mesh's cached local bounds only after a transform change
+        AABB &get_bounding_box() {
+             if (boundsDirty) {
+                  AABB &local = mesh.get_bounds();
+                  
+                  // Negative scaling swaps the corners
+                  Vec3f first = Vec3f(local.min).mul(scaling).add(position);
+                  Vec3f second = Vec3f(local.max).mul(scaling).add(position);
+                  this->boundingBox = AABB(first, first);
+                  this->boundingBox.merge(second);
+                  boundsDirty = false;
+             }
+             return this->boundingBox;
+        }
+        
+        SceneObject *set_position(const Vec3f &to) {
+             this->position = to;
+             this->transformed();
+            
+             return this;
+        }
+        SceneObject *set_scaling(const Vec3f &to) {
+             this->scaling = to;
+             this->transformed();
+            
+             return this;
+        }
+        SceneObject *set_position(float x, float y, float z) {
+             return set_position(Vec3f(x, y, z));
+        }
+        SceneObject *set_color(const Vec3f &to) {
+             this->color = to;
+             
+             return this;
+        }
+        SceneObject *set_color(float r, float g, float b) {
+             return set_color(Vec3f(r, g, b));
+        }
+        SceneObject *set_scaling(float width, float height, float depth) {
+             return set_scaling(Vec3f(width, height, depth));
+        }
+        
+        // Makes the object a point light, which shines from its position
+        SceneObject *set_light(const Light &to) {
+             this->light = std::make_shared<Light>(to);
+             
+             return this;
+        }
+        Light *get_light() { return this->light.get(); }
+        
+        // Called after the position or scaling changes
+        SceneObject *set_transform_listener(std::function<void(SceneObject*)> to) {
+             this->transformListener = to;
+             
+             return this;
+        }
+        
+        // Position inside the owning scene's object list, or -1
+        int get_scene_index() { return this->sceneIndex; }
+        void set_scene_index(int to) { this->sceneIndex = to; }
+     private:
+        void transformed() {
+             boundsDirty = true;
+             if (transformListener != NULL) transformListener(this);
+        }
+     private:
+        Mesh mesh;
+        AABB boundingBox;
+        bool boundsDirty;
+        int sceneIndex;
+        int detailLevel = 0;
+        std::shared_ptr<Light> light;
+        std::function<void(SceneObject*)> transformListener;
+};
+
+namespace BaseMeshes {
+     const RenderVertices cubeVertices = {
+         //           Position         normal
+         RenderVertex(-0.5, -0.5, 0.5,  0.0, 0.0, 1.0),
+         RenderVertex(0.5, -0.5, 0.5,  0.0, 0.0, 1.0),
+         RenderVertex(0.5, 0.5, 0.5,  0.0, 0.0, 1.0),
+         RenderVertex(-0.5, 0.5, 0.5,  0.0, 0.0, 1.0),
+       
+         RenderVertex(-0.5, 0.5, 0.5,  0.0, 1.0, 0.0),
+         RenderVertex(0.5, 0.5, 0.5,  0.0, 1.0, 0.0),
+         RenderVertex(0.5, 0.5, -0.5,  0.0, 1.0, 0.0),
+         RenderVertex(-0.5, 0.5, -0.5,  0.0, 1.0, 0.0),
+       
+         RenderVertex(0.5, -0.5, -0.5,  0.0, 0.0, -1.0),
+         RenderVertex(-0.5, -0.5, -0.5,  0.0, 0.0, -1.0),
+         RenderVertex(-0.5, 0.5, -0.5,  0.0, 0.0, -1.0),
+         RenderVertex(0.5, 0.5, -0.5,  0.0, 0.0, -1.0),
+       
+         RenderVertex(-0.5, -0.5, -0.5,  0.0, -1.0, 0.0),
+         RenderVertex(0.5, -0.5, -0.5,  0.0, -1.0, 0.0),
+         RenderVertex(0.5, -0.5, 0.5,  0.0, -1.0, 0.0),
+         RenderVertex(-0.5, -0.5, 0.5, 0.0, -1.0, 0.0),
+       
+         RenderVertex(-0.5, -0.5, -0.5,  -1.0, 0.0, 0.0),
+         RenderVertex(-0.5, -0.5, 0.5,  -1.0, 0.0, 0.0),
+         RenderVertex(-0.5, 0.5, 0.5,  -1.0, 0.0, 0.0),
+         RenderVertex(-0.5, 0.5, -0.5,  -1.0, 0.0, 0.0),
+       
+         RenderVertex(0.5, -0.5, 0.5,  1.0, 0.0, 0.0),
+         RenderVertex(0.5, -0.5, -0.5,  1.0, 0.0, 0.0),
+         RenderVertex(0.5, 0.5, -0.5,  1.0, 0.0, 0.0),  
+         RenderVertex(0.5, 0.5, 0.5,  1.0, 0.0, 0.0)
+     };
      const RenderIndices cubeIndices = {
          0, 1, 2,
          2, 3, 0,
@@ -1938,26 +4951,192 @@ namespace BaseMeshes {
      const Mesh cube = Mesh(cubeVertices, cubeIndices);
 };
 
+// Uniform grid over object bounds, with cells hashed by their integer coordinates.
+// Objects are re-inserted into the cells they overlap whenever they move.
+class SpatialHash {
+     public:
+        // Objects covering more cells than this per axis go to a list checked by every query
+        static const int maxCellSpan = 8;
+        
+        SpatialHash(float cellSize) {
+             this->cellSize = cellSize;
+        }
+        
+        void insert(SceneObject *object) {
+             CellRange range = range_of(object->get_bounding_box());
+             ranges[object] = range;
+             if (range.oversized) {
+                  oversized.push_back(object);
+                  return;
+             }
+             for (int x = range.minX; x <= range.maxX; x++) {
+                  for (int y = range.minY; y <= range.maxY; y++) {
+                       for (int z = range.minZ; z <= range.maxZ; z++) {
+                            cells[key(x, y, z)].push_back(object);
+                       }
+                  }
+             }
+        }
+        void remove(SceneObject *object) {
+             auto found = ranges.find(object);
+             if (found == ranges.end()) return;
+             
+             CellRange range = found->second;
+             ranges.erase(found);
+             if (range.oversized) {
+                  erase(oversized, object);
+                  return;
+             }
+             for (int x = range.minX; x <= range.maxX; x++) {
+                  for (int y = range.minY; y <= range.maxY; y++) {
+                       for (int z = range.minZ; z <= range.maxZ; z++) {
+                            auto cell = cells.find(key(x, y, z));
+                            if (cell == cells.end()) continue;
+                            
+                            erase(cell->second, object);
+                            if (cell->second.empty()) cells.erase(cell);
+                       }
+                  }
+             }
+        }
+        void update(SceneObject *object) {
+             auto found = ranges.find(object);
+             if (found != ranges.end() && found->second == range_of(object->get_bounding_box())) {
+                  // Still covers the same cells
+                  return;
+             }
+             remove(object);
+             insert(object);
+        }
+        
+        // Visits the objects in the cells around 'point' (a 3x3x3 block), so the cost doesn't depend
+        // on the scene size. An object can be visited more than once.
+        template <typename Function>
+        void query_neighbours(const Vec3f &point, Function visit) {
+             int cx = cell_of(point.x), cy = cell_of(point.y), cz = cell_of(point.z);
+             for (int x = cx - 1; x <= cx + 1; x++) {
+                  for (int y = cy - 1; y <= cy + 1; y++) {
+                       for (int z = cz - 1; z <= cz + 1; z++) {
+                            auto cell = cells.find(key(x, y, z));
+                            if (cell == cells.end()) continue;
+                            
+                            for (auto &object : cell->second) {
+                                 visit(object);
+                            }
+                       }
+                  }
+             }
+             for (auto &object : oversized) {
+                  visit(object);
+             }
+        }
+        
+        float get_cell_size() { return this->cellSize; }
+     private:
+        struct CellRange {
+             int minX, minY, minZ;
+             int maxX, maxY, maxZ;
+             bool oversized;
+             
+             bool operator==(const CellRange &other) const {
+                  return minX == other.minX && minY == other.minY && minZ == other.minZ &&
+                         maxX == other.maxX && maxY == other.maxY && maxZ == other.maxZ &&
+                         oversized == other.oversized;
+             }
+        };
+        
+        CellRange range_of(const AABB &box) {
+             CellRange range;
+             range.minX = cell_of(box.min.x);
+             range.minY = cell_of(box.min.y);
+             range.minZ = cell_of(box.min.z);
+             range.maxX = cell_of(box.max.x);
+             range.maxY = cell_of(box.max.y);
+             range.maxZ = cell_of(box.max.z);
+             range.oversized = (range.maxX - range.minX >= maxCellSpan) ||
+                               (range.maxY - range.minY >= maxCellSpan) ||
+                               (range.maxZ - range.minZ >= maxCellSpan);
+             return range;
+        }
+        int cell_of(float value) {
+             return (int) floor(value / cellSize);
+        }
+        // 21 bits per axis
+        static uint64_t key(int x, int y, int z) {
+             const uint64_t mask = (1 << 21) - 1;
+             return ((uint64_t(x) & mask) << 42) | ((uint64_t(y) & mask) << 21) | (uint64_t(z) & mask);
+        }
+        static void erase(std::vector<SceneObject*> &list, SceneObject *object) {
+             auto found = std::find(list.begin(), list.end(), object);
+             if (found != list.end()) {
+                  *found = list.back();
+                  list.pop_back();
+             }
+        }
+     private:
+        float cellSize;
+        std::unordered_map<uint64_t, std::vector<SceneObject*>> cells;
+        std::unordered_map<SceneObject*, CellRange> ranges;
+        std::vector<SceneObject*> oversized;
+};
+
+enum class SnapModes {
+     none,
+     grid,
+     faces
+};
+
 namespace TemporarySettings {
      bool displayGrid;
+     bool trianglePicking;
+     bool hoverHighlight;
+     bool parallelPreparation;
+     bool boxSelect;
+     SnapModes snapMode;
+     bool occlusionCulling;
+     bool showTimings;
+     bool levelOfDetail;
+     bool clusteredLighting;
      void load() {
           displayGrid = true;
+          trianglePicking = false;
+          hoverHighlight = false;
+          parallelPreparation = true;
+          boxSelect = false;
+          snapMode = SnapModes::none;
+          occlusionCulling = false;
+          showTimings = false;
+          levelOfDetail = true;
+          clusteredLighting = true;
      }
 };
 
+struct RayHit {
+     SceneObject *object = nullptr;
+     float distance = 0.0f;
+};
+
 class Scene {
      public:
         float offset = 0.0f;
         Scene() {
              objectShader = new Shader("model.vert", "model.frag");
+             // Uniforms keep their values, so the fixed light only has to be set once
+             objectShader->use();
+             objectShader->set_uniform_vec3f("lightPosition", -2.0f, 3.0f, 2.0f);
              gridShader = new Shader("grid.vert", "grid.frag");
              axisShader = new Shader("grid.vert", "axis.frag");
              outlineShader = new Shader("grid.vert", "outline.frag");
              
-             objectBatch = new Batch(4096, GL_TRIANGLES, objectShader);
              gridBatch = new Batch(1000, GL_LINES, gridShader);
              axisBatch = new Batch(1000, GL_LINES, axisShader);
-             outlineBatch = new Batch(6 * 4, GL_LINES, outlineShader);
+             outlineBatch = new Batch(8 * 256, GL_LINES, outlineShader);
+             
+             idShader = new Shader("id.vert", "id.frag");
+             idQueue = new RenderQueue();
+             workers = new ThreadPool(std::thread::hardware_concurrency());
+             pickingBuffer = new PickingBuffer(SCREEN_WIDTH, SCREEN_HEIGHT);
+             lightClusters = new LightClusters();
            
              this->xz = Plane(Vec3f(0.0f, 0.0f, 0.0f), Vec3f(0.0f, 1.0f, 0.0f));
              
@@ -1965,80 +5144,328 @@ class Scene {
              setup_grid(gridWidth, gridDepth);
              setup_axes(gridWidth, gridHeight, gridDepth);
              
+             // Neither changes afterwards, so both are uploaded once here
+             gridBatch->set_static(true)->add(grid);
+             axisBatch->set_static(true)->add(axis);
              
-             Mesh cube = BaseMeshes::cube;
-             SceneObject *obj = new SceneObject(cube.set_color(0.8f, 0.8f, 0.8f));
+             
+             SceneObject *obj = new SceneObject(BaseMeshes::cube);
+             obj->set_color(0.8f, 0.8f, 0.8f);
              add_object(obj);
-             this->selectedObject = nullptr;
+             this->hoveredObject = nullptr;
         }
        
+        // Lights have to be set on the object before it's added
         void add_object(SceneObject *object) {
+             object->set_scene_index(objects.size());
+             object->set_transform_listener([this](SceneObject *moved) { this->object_moved(moved); });
              objects.push_back(object);
+             if (object->get_light() != nullptr) lights.push_back(object);
+             objectHash.insert(object);
+             treeDirty = true;
         }
         void remove_object(SceneObject *object) {
-             int index = this->object_index(object);
-             if (index == -1) return;
+             remove_objects({ object });
+        }
+        // Removes several objects with a single pass over the object list
+        void remove_objects(const std::vector<SceneObject*> &toRemove) {
+             std::vector<char> removed(objects.size(), 0);
+             bool any = false;
+             for (auto &object : toRemove) {
+                  int index = object->get_scene_index();
+                  if (index < 0 || index >= objects.size() || objects.at(index) != object) continue;
+                  
+                  removed[index] = 1;
+                  any = true;
+             }
+             if (!any) return;
+             
+             std::vector<SceneObject*> deleted;
+             int kept = 0;
+             for (int i = 0; i < removed.size(); i++) {
+                  SceneObject *object = objects.at(i);
+                  if (removed[i]) {
+                       object->set_scene_index(-1);
+                       deleted.push_back(object);
+                       continue;
+                  }
+                  object->set_scene_index(kept);
+                  objects[kept++] = object;
+             }
+             objects.resize(kept);
+             treeDirty = true;
+             
+             // Nothing may keep pointing at the deleted objects
+             std::vector<SceneObject*> remaining;
+             for (auto &object : selection) {
+                  if (object->get_scene_index() != -1) remaining.push_back(object);
+             }
+             selection = remaining;
+             if (hoveredObject != nullptr && hoveredObject->get_scene_index() == -1) hoveredObject = nullptr;
+             lights.erase(std::remove_if(lights.begin(), lights.end(), [](SceneObject *light) { return light->get_scene_index() == -1; }), lights.end());
+             
+             // Pending picking reads refer to the old indices
+             pickingBuffer->discard();
+             
+             for (auto &object : deleted) {
+                  objectHash.remove(object);
+                  delete object;
+             }
+        }
+        void object_moved(SceneObject *object) {
+             if (!treeDirty) {
+                  objectTree.refit(object->get_scene_index(), object->get_bounding_box());
+             }
+             objectHash.update(object);
+        }
+        
+        // Where an object with the given half size would go when placed at 'point'
+        Vec3f snap(const Vec3f &point, const Vec3f &halfSize) {
+             if (TemporarySettings::snapMode == SnapModes::grid) {
+                  return Vec3f(round(point.x / gridStep) * gridStep,
+                               round(point.y / gridStep) * gridStep,
+                               round(point.z / gridStep) * gridStep);
+             }
+             if (TemporarySettings::snapMode == SnapModes::faces) {
+                  return snap_to_faces(point, halfSize);
+             }
+             return point;
+        }
+        
+        // Moves the point so that a box of 'halfSize' around it rests against the face of the nearest
+        // neighbouring object, if one is within snapDistance. Only the surrounding hash cells are searched.
+        Vec3f snap_to_faces(const Vec3f &point, const Vec3f &halfSize) {
+             Vec3f result = point;
+             float nearest = snapDistance;
              
-             objects.erase(objects.begin() + index);
-             delete object;
+             objectHash.query_neighbours(point, [&](SceneObject *object) {
+                  // Centers touching the object lie on its bounds grown by the half size
+                  AABB box = object->get_bounding_box();
+                  AABB grown = AABB(Vec3f(box.min).sub(halfSize), Vec3f(box.max).add(halfSize));
+                  
+                  Vec3f candidate = point;
+                  if (grown.point_inside(point)) {
+                       // Push out through the closest face
+                       float distances[6] = {
+                            point.x - grown.min.x, grown.max.x - point.x,
+                            point.y - grown.min.y, grown.max.y - point.y,
+                            point.z - grown.min.z, grown.max.z - point.z
+                       };
+                       int face = std::min_element(distances, distances + 6) - distances;
+                       if (face == 0) candidate.x = grown.min.x;
+                       if (face == 1) candidate.x = grown.max.x;
+                       if (face == 2) candidate.y = grown.min.y;
+                       if (face == 3) candidate.y = grown.max.y;
+                       if (face == 4) candidate.z = grown.min.z;
+                       if (face == 5) candidate.z = grown.max.z;
+                  } else {
+                       candidate.x = std::min(std::max(point.x, grown.min.x), grown.max.x);
+                       candidate.y = std::min(std::max(point.y, grown.min.y), grown.max.y);
+                       candidate.z = std::min(std::max(point.z, grown.min.z), grown.max.z);
+                  }
+                  
+                  float distance = Vec3f(candidate).sub(point).len();
+                  if (distance < nearest) {
+                       nearest = distance;
+                       result = candidate;
+                  }
+             });
+             return result;
+        }
+        
+        // Where the crosshair ray meets the XZ plane, snapped
+        Vec3f placement(Camera *camera, const Vec3f &halfSize) {
+             Vec3f intersection = xz.intersect_line(camera->position, camera->get_direction());
+             return snap(intersection, halfSize);
+        }
+        void set_preview(bool visible, const Vec3f &position, const Vec3f &halfSize) {
+             this->previewVisible = visible;
+             this->preview = AABB(Vec3f(position).sub(halfSize), Vec3f(position).add(halfSize));
         }
         void update(float timeTook) {
              offset += timeTook;
         }
-        void render(Camera *camera) {
-             Mat4x4 model;
+        // Submits every pass of the scene to the queue, which decides the drawing order
+        void render(Camera *camera, RenderQueue *queue) {
+             Timing::Scope scope("scene");
              
-             // 1st pass - grid
              if (TemporarySettings::displayGrid) {
-                  gridShader->use();
-                  gridShader->set_uniform_mat4("model", model);
-                  gridShader->set_uniform_mat4("view", camera->get_view());
-                  gridShader->set_uniform_mat4("projection", camera->get_projection());
-           
-                  gridBatch->add(grid);
-                  glLineWidth(2);
-                  gridBatch->render();
+                  queue->submit(RenderPasses::grid, gridShader, 0, [this]() {
+                       gridShader->set_uniform_mat4("model", Mat4x4());
+                       GLState::line_width(2);
+                       gridBatch->render();
+                  });
+             }
+             queue->submit(RenderPasses::axes, axisShader, 0, [this]() {
+                  axisShader->set_uniform_mat4("model", Mat4x4());
+                  GLState::line_width(3);
+                  axisBatch->render();
+             });
+             queue->submit(RenderPasses::outlines, outlineShader, 0, [this]() {
+                  outlineShader->set_uniform_mat4("model", Mat4x4());
+                  outlineShader->set_uniform_float("uTime", offset);
+                  
+                  for (auto &object : selection) {
+                       this->draw_bounding_box(object);
+                  }
+                  if (hoveredObject != nullptr && hoveredObject != get_selected()) {
+                       this->draw_bounding_box(hoveredObject, Vec3f(1.0f, 0.8f, 0.2f));
+                  }
+                  if (previewVisible) {
+                       this->draw_box(preview, Vec3f(0.2f, 0.9f, 1.0f));
+                  }
+                  outlineBatch->render();
+                  GLState::line_width(1);
+             });
+             
+             cull(camera->get_frustum());
+             if (TemporarySettings::occlusionCulling) {
+                  cull_occluded(camera);
              }
              
-             // 2nd pass - coordinate axes
-             axisShader->use();
-             axisShader->set_uniform_mat4("model", model);
-             axisShader->set_uniform_mat4("view", camera->get_view());
-             axisShader->set_uniform_mat4("projection", camera->get_projection());
+             // Levels, bounds, depths and instances are worked out on the pool, each thread submitting
+             // into its own region of the queue. Meshes that still need uploading wait for this thread.
+             // Allowing no error at all brings back the full mesh.
+             float maxError = TemporarySettings::levelOfDetail ? maxDetailError : 0.0f;
+             bin_lights(camera);
+             queue->prepare_regions(workers->get_size());
+             pending.resize(workers->get_size());
+             split(visibleObjects.size(), [this, camera, queue, maxError](int first, int last, int worker) {
+                  for (int i = first; i < last; i++) {
+                       SceneObject *object = visibleObjects[i];
+                       object->select_detail(camera, maxError);
+                       if (!object->prepare(queue, worker, objectShader, depth_of(object, camera), object->color)) {
+                            pending[worker].push_back(i);
+                       }
+                  }
+             });
+             for (auto &indices : pending) {
+                  for (auto &i : indices) {
+                       visibleObjects[i]->render(queue, objectShader, depth_of(visibleObjects[i], camera));
+                  }
+                  indices.clear();
+             }
+        }
+        // Sorts the lights into the clusters of the camera's view, for the object shader to read
+        void bin_lights(Camera *camera) {
+             Timing::Scope scope("lights");
              
-             axisBatch->add(axis);
-             if (selectedObject != nullptr) {
-                  this->draw_bounding_box(selectedObject);
+             lightClusters->clear();
+             for (auto &light : lights) {
+                  lightClusters->add(light->position, *light->get_light());
+             }
+             lightClusters->set_binned(TemporarySettings::clusteredLighting)->upload(camera);
+             lightClusters->bind(objectShader);
+        }
+        // Runs task(first, last, worker) over [0, count) on the pool, or at once on this thread
+        // when there is too little work to be worth waking it
+        void split(int count, std::function<void(int, int, int)> task) {
+             if (TemporarySettings::parallelPreparation && workers->get_size() > 1 && count >= parallelThreshold) {
+                  workers->run(count, task);
+             } else {
+                  task(0, count, 0);
              }
-             glLineWidth(3);
-             axisBatch->render();
+        }
+        // Distance of the object's center along the view direction, as a fraction of the far plane
+        float depth_of(SceneObject *object, Camera *camera) {
+             AABB &box = object->get_bounding_box();
+             Vec3f center = Vec3f(box.min).add(box.max).mul(0.5f);
+             Vec3f direction = camera->get_direction();
+             return center.sub(camera->position).dot_prod(direction) / camera->get_far();
+        }
+        // Keeps the objects whose bounding boxes touch the frustum. Large scenes can
+        // split the test across the pool, each thread writing to its own part of the flags.
+        void cull(const Frustum &frustum) {
+             int count = objects.size();
+             visibility.assign(count, 0);
              
-             outlineShader->use();
-             outlineShader->set_uniform_mat4("model", model);
-             outlineShader->set_uniform_mat4("view", camera->get_view());
-             outlineShader->set_uniform_mat4("projection", camera->get_projection());
-             outlineShader->set_uniform_float("uTime", offset);
+             split(count, [this, &frustum](int first, int last, int /*worker*/) {
+                  for (int i = first; i < last; i++) {
+                       visibility[i] = frustum.intersects(objects[i]->get_bounding_box());
+                  }
+             });
              
-             if (selectedObject != nullptr) {
-                  this->draw_bounding_box(selectedObject);
+             visibleObjects.clear();
+             for (int i = 0; i < count; i++) {
+                  if (visibility[i]) visibleObjects.push_back(objects[i]);
              }
-             outlineBatch->render();
+             culledCount = count - visibleObjects.size();
+        }
+        
+        // Rasterizes the biggest visible objects on screen into the occlusion buffer, then drops
+        // the visible objects whose bounds are entirely behind them
+        void cull_occluded(Camera *camera) {
+             occludedCount = 0;
+             if (visibleObjects.size() < minOccludees) return;
              
-             // 3rd pass - model
-             objectShader->use();
-             objectShader->set_uniform_mat4("model", model);
-             objectShader->set_uniform_mat4("view", camera->get_view());
-             objectShader->set_uniform_mat4("projection", camera->get_projection());
+             // Rank small meshes by how large they look from the camera
+             std::vector<std::pair<float, SceneObject*>> candidates;
+             for (auto &object : visibleObjects) {
+                  if (object->get_mesh().triangle_count() > maxOccluderTriangles) continue;
+                  
+                  AABB &box = object->get_bounding_box();
+                  float size = Vec3f(box.max).sub(box.min).len();
+                  float distance = std::max(Vec3f(box.center()).sub(camera->position).len(), 1e-3f);
+                  candidates.push_back(std::make_pair(size / distance, object));
+             }
+             int occluders = std::min((int) candidates.size(), maxOccluders);
+             std::partial_sort(candidates.begin(), candidates.begin() + occluders, candidates.end(),
+                  [](const std::pair<float, SceneObject*> &a, const std::pair<float, SceneObject*> &b) { return a.first > b.first; });
              
-             objectShader->set_uniform_vec3f("lightPosition", -2.0f, 3.0f, 2.0f);
-           
-             for (auto &object : objects) {
-                  object->render(objectBatch);
+             occlusionBuffer.begin(camera->get_combined());
+             for (int i = 0; i < occluders; i++) {
+                  SceneObject *object = candidates[i].second;
+                  Mesh &mesh = object->get_mesh();
+                  occlusionBuffer.add_occluder(mesh.renderVertices, mesh.indices, object->scaling, object->position);
+             }
+             occlusionBuffer.build_hierarchy();
+             
+             int kept = 0;
+             for (auto &object : visibleObjects) {
+                  if (occlusionBuffer.is_occluded(object->get_bounding_box())) continue;
+                  visibleObjects[kept++] = object;
+             }
+             occludedCount = visibleObjects.size() - kept;
+             culledCount += occludedCount;
+             visibleObjects.resize(kept);
+        }
+        
+        // Draws every object with its ID color into the picking buffer, then queues a read of the
+        // pixel at (u, v). The hovered object follows whichever read finishes first.
+        void render_ids(Camera *camera, float u, float v) {
+             Timing::Scope scope("picking", true);
+             
+             uint id = 0;
+             if (pickingBuffer->poll(id)) {
+                  hoveredObject = (id > 0 && id <= objects.size()) ? objects.at(id - 1) : nullptr;
+             }
+             
+             pickingBuffer->begin();
+             idQueue->prepare_regions(workers->get_size());
+             pending.resize(workers->get_size());
+             split(objects.size(), [this, camera](int first, int last, int worker) {
+                  for (int i = first; i < last; i++) {
+                       if (!objects[i]->prepare(idQueue, worker, idShader, depth_of(objects[i], camera), PickingBuffer::encode(i + 1))) {
+                            pending[worker].push_back(i);
+                       }
+                  }
+             });
+             for (auto &indices : pending) {
+                  for (auto &i : indices) {
+                       objects[i]->render(idQueue, idShader, depth_of(objects[i], camera), PickingBuffer::encode(i + 1));
+                  }
+                  indices.clear();
              }
-             glLineWidth(1);
-             objectBatch->render();
+             idQueue->render();
+             
+             pickingBuffer->request(u, v);
+             pickingBuffer->end();
+        }
+        
+        void draw_bounding_box(SceneObject *object, const Vec3f &color = Vec3f(1.0f, 1.0f, 1.0f)) {
+             draw_box(object->get_bounding_box(), color);
         }
-        void draw_bounding_box(SceneObject *object) {
+        void draw_box(const AABB &aabb, const Vec3f &color) {
              RenderVertices outline = {
                    RenderVertex(-1.0, -1.0, -1.0),
                    RenderVertex(1.0, -1.0, -1.0),
@@ -2049,45 +5476,175 @@ class Scene {
                    RenderVertex(1.0, -1.0, 1.0),
                    RenderVertex(-1.0, 1.0, 1.0),
                    RenderVertex(1.0, 1.0, 1.0),
-            
-                   RenderVertex(-1.0, -1.0, -1.0),
-                   RenderVertex(-1.0, 1.0, -1.0),
-                   RenderVertex(1.0, -1.0, -1.0),
-                   RenderVertex(1.0, 1.0, -1.0),
-            
-                   RenderVertex(-1.0, -1.0, 1.0),
-                   RenderVertex(-1.0, 1.0, 1.0),
-                   RenderVertex(1.0, 1.0, 1.0),
-                   RenderVertex(1.0, -1.0, 1.0),
-                 
-                   RenderVertex(-1.0, -1.0, -1.0),
-                   RenderVertex(-1.0, -1.0, 1.0),
-                   RenderVertex(1.0, -1.0, -1.0),
-                   RenderVertex(1.0, -1.0, 1.0),
-            
-                   RenderVertex(-1.0, 1.0, -1.0),
-                   RenderVertex(-1.0, 1.0, 1.0),
-                   RenderVertex(1.0, 1.0, -1.0),
-                   RenderVertex(1.0, 1.0, 1.0),
              };
+             // The 12 edges between the corners above
+             static const RenderIndices edges = {
+                   0, 1,  2, 3,  4, 5,  6, 7,
+                   0, 2,  1, 3,  4, 6,  5, 7,
+                   0, 4,  1, 5,  2, 6,  3, 7
+             };
+             
+             Vec3f gradient = Vec3f(aabb.max).sub(aabb.min);
+             Vec3f center = aabb.center();
+             for (auto &vertex : outline) {
+                  vertex.Position.mul(gradient);
+                  vertex.Position.mul(0.5f);
+                  vertex.Position.add(center);
+                  vertex.Color = color;
+             }
+             
+             outlineBatch->add(outline, edges);
+        }
+        
+        Plane get_XZ_plane() { return xz; }
+        void set_selected(SceneObject *object) {
+             this->selection.clear();
+             if (object != nullptr) this->selection.push_back(object);
+        }
+        // The first selected object, or null
+        SceneObject *get_selected() { return this->selection.empty() ? nullptr : this->selection.front(); }
+        std::vector<SceneObject*> &get_selection() { return this->selection; }
+        void set_selection(const std::vector<SceneObject*> &to) {
+             this->selection = to;
+        }
+        
+        // Selects every object whose bounds reach into a screen rectangle, given in normalized device
+        // coordinates. The rectangle narrows the view frustum, which is then queried through the hierarchy.
+        void select_rectangle(Camera *camera, float x1, float y1, float x2, float y2) {
+             Frustum frustum = Frustum(camera->get_combined(), std::min(x1, x2), std::min(y1, y2), std::max(x1, x2), std::max(y1, y2));
+             set_selection(query_frustum(frustum));
+        }
+        SceneObject *get_hovered() { return this->hoveredObject; }
+        void set_hovered(SceneObject *object) {
+             this->hoveredObject = object;
+        }
+        std::vector<SceneObject*> &get_objects() { return this->objects; }
+        
+        // Objects left out of the last rendered frame, and how many of those were hidden by others
+        int get_culled_count() { return this->culledCount; }
+        int get_occluded_count() { return this->occludedCount; }
+        std::vector<SceneObject*> &get_lights() { return this->lights; }
+        
+        // Nearest object whose bounding box is hit by the ray
+        RayHit ray_cast(const Vec3f &origin, const Vec3f &direction, float maxLength) {
+             RayHit result;
+             update_tree();
+             
+             float nearest = maxLength;
+             objectTree.traverse_ray(origin, direction, nearest, [&](int primitive, float &maxLength) {
+                  SceneObject *object = objects.at(primitive);
+                  float distance = 0.0f;
+                  if (object->get_bounding_box().intersect_ray(origin, direction, maxLength, distance)) {
+                       maxLength = distance;
+                       result.object = object;
+                       result.distance = distance;
+                  }
+             });
+             return result;
+        }
+        // Nearest triangle hit by the ray. Objects are only scaled and translated, so the ray
+        // is moved into each mesh's local space where distances along it stay the same.
+        TriangleHit pick_triangle(const Vec3f &origin, const Vec3f &direction, float maxLength) {
+             TriangleHit result;
+             update_tree();
+             
+             float nearest = maxLength;
+             objectTree.traverse_ray(origin, direction, nearest, [&](int primitive, float &maxLength) {
+                  SceneObject *object = objects.at(primitive);
+                  float distance = 0.0f;
+                  if (!object->get_bounding_box().intersect_ray(origin, direction, maxLength, distance)) return;
+                  
+                  Vec3f scaling = object->scaling;
+                  if (scaling.x == 0.0f || scaling.y == 0.0f || scaling.z == 0.0f) return;
+                  
+                  Vec3f inverseScaling = Vec3f(1.0f / scaling.x, 1.0f / scaling.y, 1.0f / scaling.z);
+                  Vec3f localOrigin = Vec3f(origin).sub(object->position).mul(inverseScaling);
+                  Vec3f localDirection = Vec3f(direction).mul(inverseScaling);
+                  
+                  TriangleHit hit;
+                  if (object->get_mesh().intersect_ray(localOrigin, localDirection, maxLength, hit)) {
+                       maxLength = hit.distance;
+                       result = hit;
+                       result.object = object;
+                  }
+             });
+             return result;
+        }
+        // Packet versions of ray_cast and pick_triangle, for many rays at once (hover refinement,
+        // marquee picking). 'hits' receives one result per ray of the packet.
+        void ray_cast_packet(RayPacket &packet, RayHit *hits) {
+             update_tree();
+             for (int i = 0; i < packet.size; i++) {
+                  hits[i] = RayHit();
+             }
              
-             AABB aabb = object->get_bounding_box();
-             Vec3f gradient = Vec3f(aabb.max).sub(aabb.min);
-             for (auto &vertex : outline) {
-                  vertex.Position.mul(gradient);
-                  vertex.Position.mul(0.5f);
-                  vertex.Position.add(object->position);
+             alignas(32) float entry[RayPacket::maxSize];
+             objectTree.traverse_packet(packet, [&](int primitive) {
+                  SceneObject *object = objects.at(primitive);
+                  int mask = PacketKernels::intersect_box(packet, object->get_bounding_box(), entry);
+                  for (int i = 0; mask != 0; i++, mask >>= 1) {
+                       if (!(mask & 1)) continue;
+                       packet.maxLength[i] = entry[i];
+                       packet.hit[i] = primitive;
+                       hits[i].object = object;
+                       hits[i].distance = entry[i];
+                  }
+             });
+        }
+        void pick_triangle_packet(RayPacket &packet, TriangleHit *hits) {
+             update_tree();
+             for (int i = 0; i < packet.size; i++) {
+                  hits[i] = TriangleHit();
              }
              
-             outlineBatch->add(outline);
+             alignas(32) float entry[RayPacket::maxSize];
+             RayPacket local;
+             objectTree.traverse_packet(packet, [&](int primitive) {
+                  SceneObject *object = objects.at(primitive);
+                  int mask = PacketKernels::intersect_box(packet, object->get_bounding_box(), entry);
+                  if (mask == 0) return;
+                  
+                  Vec3f scaling = object->scaling;
+                  if (scaling.x == 0.0f || scaling.y == 0.0f || scaling.z == 0.0f) return;
+                  Vec3f inverseScaling = Vec3f(1.0f / scaling.x, 1.0f / scaling.y, 1.0f / scaling.z);
+                  
+                  // Only the rays reaching the object's box are moved into its local space
+                  local.clear();
+                  local.size = packet.size;
+                  for (int i = 0; i < packet.size; i++) {
+                       if (!(mask & (1 << i))) continue;
+                       Vec3f localOrigin = packet.get_origin(i).sub(object->position).mul(inverseScaling);
+                       Vec3f localDirection = packet.get_direction(i).mul(inverseScaling);
+                       local.set(i, localOrigin, localDirection, packet.maxLength[i]);
+                  }
+                  
+                  int updated = object->get_mesh().intersect_packet(local);
+                  for (int i = 0; updated != 0; i++, updated >>= 1) {
+                       if (!(updated & 1)) continue;
+                       packet.maxLength[i] = local.maxLength[i];
+                       packet.hit[i] = primitive;
+                       hits[i].object = object;
+                       hits[i].triangle = local.hit[i];
+                       hits[i].distance = local.maxLength[i];
+                       hits[i].u = local.u[i];
+                       hits[i].v = local.v[i];
+                  }
+             });
         }
-        
-        Plane get_XZ_plane() { return xz; }
-        void set_selected(SceneObject *object) {
-             this->selectedObject = object;
+        std::vector<SceneObject*> query_box(const AABB &box) {
+             std::vector<int> indices;
+             update_tree();
+             objectTree.query_box(box, indices);
+             
+             return this->to_objects(indices);
+        }
+        std::vector<SceneObject*> query_frustum(const Frustum &frustum) {
+             std::vector<int> indices;
+             update_tree();
+             objectTree.query_frustum(frustum, indices);
+             
+             return this->to_objects(indices);
         }
-        SceneObject *get_selected() { return this->selectedObject; }
-        std::vector<SceneObject*> &get_objects() { return this->objects; }
         
         int object_index(SceneObject *object) {
              for (int i = 0; i < objects.size(); i++) {
@@ -2106,8 +5663,9 @@ class Scene {
              write << std::fixed;
              write << std::setprecision(5);
              
-             // Vertex positions
+             // Vertex positions. Light markers aren't part of the model.
              for (auto &object : objects) {
+                  if (object->get_light() != nullptr) continue;
                   RenderVertices vertices = object->get_mesh().renderVertices;
                   for (auto &vertex : vertices) {
                         Vec3f position = vertex.Position;
@@ -2121,6 +5679,7 @@ class Scene {
              
              // Vertex normals
              for (auto &object : objects) {
+                  if (object->get_light() != nullptr) continue;
                   RenderVertices vertices = object->get_mesh().renderVertices;
                   for (auto &vertex : vertices) {
                         Vec3f normal = vertex.Normal;
@@ -2134,6 +5693,7 @@ class Scene {
              RenderIndices indices;
              uint indexCount = 0;
              for (auto &object : objects) {
+                  if (object->get_light() != nullptr) continue;
                   RenderIndices indices2 = object->get_mesh().indices;
                   for (auto &index : indices2) {
                        uint indx = index + indexCount + 1;
@@ -2164,13 +5724,41 @@ class Scene {
              axisShader->clear();
              objectShader->clear();
              outlineShader->clear();
+             idShader->clear();
              
              gridBatch->dispose();
              axisBatch->dispose();
-             objectBatch->dispose();
              outlineBatch->dispose();
+             idQueue->dispose();
+             pickingBuffer->dispose();
+             lightClusters->dispose();
+             delete workers;
+             for (auto &object : objects) {
+                  object->get_mesh().dispose();
+             }
         }
      private:
+        // Rebuilds the hierarchy after objects were added or removed
+        void update_tree() {
+             if (!treeDirty) return;
+             
+             std::vector<AABB> bounds;
+             bounds.reserve(objects.size());
+             for (auto &object : objects) {
+                  bounds.push_back(object->get_bounding_box());
+             }
+             objectTree.build(bounds);
+             treeDirty = false;
+        }
+        std::vector<SceneObject*> to_objects(const std::vector<int> &indices) {
+             std::vector<SceneObject*> result;
+             result.reserve(indices.size());
+             for (auto &index : indices) {
+                  result.push_back(objects.at(index));
+             }
+             return result;
+        }
+        
         void setup_grid(int width, int depth) {
              Vec3f gridColor = Vec3f(0.85f, 0.85f, 0.85f);
              
@@ -2206,9 +5794,42 @@ class Scene {
         
      private:
         std::vector<SceneObject*> objects;
-        Batch *objectBatch, *gridBatch, *axisBatch, *outlineBatch;
-        Shader *objectShader, *gridShader, *axisShader, *outlineShader;
-        SceneObject *selectedObject;
+        BVH objectTree;
+        bool treeDirty = true;
+        
+        SpatialHash objectHash = SpatialHash(2.0f);
+        const float gridStep = 1.0f;
+        const float snapDistance = 1.0f;
+        bool previewVisible = false;
+        AABB preview;
+        
+        static const int parallelThreshold = 4096;
+        ThreadPool *workers;
+        
+        // The objects carrying lights
+        std::vector<SceneObject*> lights;
+        LightClusters *lightClusters;
+        
+        // Per worker, the objects left for this thread because their meshes need uploading
+        std::vector<std::vector<int>> pending;
+        std::vector<SceneObject*> visibleObjects;
+        std::vector<char> visibility;
+        int culledCount = 0;
+        
+        static const int minOccludees = 32;
+        static const int maxOccluders = 16;
+        static const int maxOccluderTriangles = 256;
+        
+        // Pixels a simplified level may be off by on screen
+        static constexpr float maxDetailError = 1.0f;
+        OcclusionBuffer occlusionBuffer;
+        int occludedCount = 0;
+        Batch *gridBatch, *axisBatch, *outlineBatch;
+        RenderQueue *idQueue;
+        Shader *objectShader, *gridShader, *axisShader, *outlineShader, *idShader;
+        PickingBuffer *pickingBuffer;
+        SceneObject *hoveredObject;
+        std::vector<SceneObject*> selection;
         
         RenderVertices grid, axis;
         Plane xz;
@@ -2218,6 +5839,7 @@ namespace Variables {
      Camera *camera;
      CameraControls *controls;
      Scene *scene;
+     RenderQueue *renderQueue;
     
      void load() {
           camera = new Camera();
@@ -2225,10 +5847,12 @@ namespace Variables {
           camera->position = Vec3f(1.0f, 1.0f, 1.0f);
            
           scene = new Scene();
-          
+          renderQueue = new RenderQueue();
+          renderQueue->set_timed(true);
      }
      void dispose() {
           scene->dispose();
+          renderQueue->dispose();
      }
 };
 
@@ -2239,46 +5863,56 @@ struct Ray {
      Ray() {}
      Ray(Vec3f start, Vec3f direction, float maxLength) : start(start), direction(direction), maxLength(maxLength) {}
      
+     // Returns the nearest object whose bounding box is hit within maxLength
+     RayHit cast() {
+          return Variables::scene->ray_cast(start, direction, maxLength);
+     }
+     TriangleHit cast_triangles() {
+          return Variables::scene->pick_triangle(start, direction, maxLength);
+     }
      SceneObject *intersect() {
-          if (Variables::scene->get_objects().empty()) return nullptr;
-          
-          float length = 0.0f;
-          Vec3f tip = Vec3f(this->start);
-          Vec3f offset = Vec3f(this->direction).mul(0.01f);
-          
-          int steps = 0;
-          while (length < maxLength) {
-                steps++;
-                tip.add(offset);
-                for (auto &object : Variables::scene->get_objects()) {
-                     if (object->get_bounding_box().point_inside(tip)) {
-                          return object;
-                     }
-                }
-                
-                
-                length += 0.01f;
+          if (TemporarySettings::trianglePicking) {
+               return cast_triangles().object;
           }
-          return nullptr;
+          return cast().object;
      }
 };
 
 namespace UI {
-     Label *positionLabel;
-     Button *select;
+     Label *positionLabel, *cullingLabel, *streamingLabel;
+     TimingPanel *timingPanel;
+     Button *select, *snapButton;
      TextField *x, *y, *z, *scalingX, *scalingY, *scalingZ;
+     TextField *lightRadius, *lightColor;
      TextField *projectName;
+     
+     // The object the light fields were last filled in for
+     SceneObject *inspected = nullptr;
      Table *meshesTable, *propertiesTable, *projectTable;
      std::vector<Cell*> uiObjects;
      Mat4x4 projection;
      bool focused = false;
      int selectionIndex = 0;
      
+     // Marquee selection, in UI coordinates
+     bool boxSelecting = false;
+     Vec2f boxStart, boxEnd;
+     
      void add(Cell *obj) {
            uiObjects.push_back(obj);
      }
+     
+     // Shows where the Cube button would place a cube while snapping is on
+     void update_preview() {
+           Vec3f halfSize = Vec3f(0.5f, 0.5f, 0.5f);
+           bool visible = TemporarySettings::snapMode != SnapModes::none;
+           Vec3f position = visible ? Variables::scene->placement(Variables::camera, halfSize) : Vec3f(0.0f, 0.0f, 0.0f);
+           Variables::scene->set_preview(visible, position, halfSize);
+     }
+     
      void load() {
            projection.set_orthographic(-SCREEN_WIDTH / 2.0f, SCREEN_WIDTH / 2.0f, -SCREEN_HEIGHT / 2.0f, SCREEN_HEIGHT / 2.0f, -2.0f, 1000.0f);
+           Renderer::set_overlay_projection(projection);
            focusedTextField = nullptr;
            
            Label *label = new Label("+");
@@ -2288,6 +5922,39 @@ namespace UI {
            check->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f + 10);
            add(check);
            
+           CheckBox *exactPicking = new CheckBox("Pick triangles", false, [](bool checked){ TemporarySettings::trianglePicking = checked; });
+           exactPicking->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f - 15);
+           add(exactPicking);
+           
+           CheckBox *hover = new CheckBox("Hover highlight", false, [](bool checked){
+                 TemporarySettings::hoverHighlight = checked;
+                 if (!checked) Variables::scene->set_hovered(nullptr);
+           });
+           hover->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f - 40);
+           add(hover);
+           
+           CheckBox *boxSelect = new CheckBox("Box select", false, [](bool checked){
+                 TemporarySettings::boxSelect = checked;
+                 boxSelecting = false;
+           });
+           boxSelect->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f - 65);
+           add(boxSelect);
+           
+           CheckBox *occlusion = new CheckBox("Occlusion culling", false, [](bool checked){ TemporarySettings::occlusionCulling = checked; });
+           occlusion->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f - 90);
+           add(occlusion);
+           
+           CheckBox *timings = new CheckBox("Show timings", false, [](bool checked){ TemporarySettings::showTimings = checked; });
+           timings->set_position(SCREEN_WIDTH * 0.25f + 10, SCREEN_HEIGHT * 0.35f - 115);
+           add(timings);
+           
+           timingPanel = new TimingPanel();
+           timingPanel->set_position(-0.48f * SCREEN_WIDTH, 0.2f * SCREEN_HEIGHT);
+           timingPanel->update([](){
+                timingPanel->set_visibility(TemporarySettings::showTimings);
+           });
+           add(timingPanel);
+           
            select = new Button("Select", [](){
                  Camera *camera = Variables::camera;
                  Vec3f direction = camera->get_direction();
@@ -2308,32 +5975,71 @@ namespace UI {
            select->set_position(0.4f * SCREEN_WIDTH, -0.4f * SCREEN_HEIGHT);  
            add(select);
              
-           meshesTable = new Table("Meshes", SCREEN_WIDTH * 0.4f, 0.0f, 120.0f, 200.0f);
+           meshesTable = new Table("Meshes", SCREEN_WIDTH * 0.4f, -SCREEN_HEIGHT * 0.08f - 25, 120.0f, 200.0f);
            
-           propertiesTable = new Table("Object Properties", -SCREEN_WIDTH * 0.32f, -SCREEN_HEIGHT * 0.2f, 180.0f, 220.0f);
+           propertiesTable = new Table("Object Properties", -SCREEN_WIDTH * 0.32f, -SCREEN_HEIGHT * 0.2f, 180.0f, 235.0f);
            propertiesTable->update([](){
                 bool selected = Variables::scene->get_selected() != nullptr;
                 propertiesTable->set_visibility(selected);
+                
+                // Selecting a single light shows its values. Anything else empties the fields, so that
+                // Apply leaves the lights of a bulk selection as they are.
+                std::vector<SceneObject*> &selection = Variables::scene->get_selection();
+                SceneObject *object = selection.size() == 1 ? selection.front() : nullptr;
+                if (object == inspected) return;
+                inspected = object;
+                
+                Light *light = object != nullptr ? object->get_light() : nullptr;
+                char radius[32] = "", color[64] = "";
+                if (light != nullptr) {
+                     snprintf(radius, sizeof(radius), "%.3g", light->radius);
+                     snprintf(color, sizeof(color), "%.3g, %.3g, %.3g", light->color.x, light->color.y, light->color.z);
+                }
+                lightRadius->set_text(radius);
+                lightColor->set_text(color);
            });
            
            projectTable = new Table("Project", -SCREEN_WIDTH * 0.34f, SCREEN_HEIGHT * 0.35f, 180.0f, 110.0f);
            
            Button *button = new Button("Cube", [](){
-                 Plane plane = Variables::scene->get_XZ_plane();
-                 Camera *camera = Variables::camera;
-                 Vec3f direction = camera->get_direction();
-                 Vec3f intersection = plane.intersect_line(camera->position, direction);
+                 Vec3f position = Variables::scene->placement(Variables::camera, Vec3f(0.5f, 0.5f, 0.5f));
                  
-                 Mesh mesh = BaseMeshes::cube;
-                 SceneObject *cube = new SceneObject(mesh.set_color(0.8f, 0.8f, 0.8f));
-                 cube->set_position(intersection);
+                 // Every cube shares the base mesh's GPU buffer and gets drawn in the same instanced call
+                 SceneObject *cube = new SceneObject(BaseMeshes::cube);
+                 cube->set_color(0.8f, 0.8f, 0.8f)->set_position(position);
                  
                  Variables::scene->add_object(cube);
                  Variables::scene->set_selected(cube);
            });
            
+           Button *lightButton = new Button("Light", [](){
+                 Vec3f position = Variables::scene->placement(Variables::camera, Vec3f(0.1f, 0.1f, 0.1f));
+                 
+                 // A small marker to select the light by, raised so it lights up what's around it
+                 SceneObject *light = new SceneObject(BaseMeshes::cube);
+                 light->set_light(Light())->set_color(1.0f, 1.0f, 1.0f)->set_scaling(0.2f, 0.2f, 0.2f);
+                 light->set_position(position.x, position.y + 1.0f, position.z);
+                 
+                 Variables::scene->add_object(light);
+                 Variables::scene->set_selected(light);
+           });
+           
            Button *button2 = new Button("Sphere (soon)", [](){});
            
+           snapButton = new Button("Snap: none", [](){
+                 if (TemporarySettings::snapMode == SnapModes::none) {
+                      TemporarySettings::snapMode = SnapModes::grid;
+                      snapButton->set_label("Snap: grid");
+                 } else if (TemporarySettings::snapMode == SnapModes::grid) {
+                      TemporarySettings::snapMode = SnapModes::faces;
+                      snapButton->set_label("Snap: faces");
+                 } else {
+                      TemporarySettings::snapMode = SnapModes::none;
+                      snapButton->set_label("Snap: none");
+                 }
+                 update_preview();
+           });
+           
            Button *button3 = new Button("Deselect", [](){
                  Variables::scene->set_selected(nullptr);
            });
@@ -2347,7 +6053,6 @@ namespace UI {
            
            z = new TextField("Z:", "", TextFieldFilters::floats);
            z->set_size(60.0f, 15.0f);
-           z->set_paddingY(15.0f);
            
            scalingX = new TextField("SclX:", "", TextFieldFilters::floats);
            scalingX->set_size(60.0f, 15.0f);
@@ -2361,37 +6066,56 @@ namespace UI {
            scalingZ->set_size(60.0f, 15.0f);
            scalingZ->set_paddingX(25.0f);
            
+           // Only used by lights. The color goes in as "r, g, b", where values over 1 make it brighter.
+           lightRadius = new TextField("Rad:", "", TextFieldFilters::floats);
+           lightRadius->set_size(60.0f, 15.0f);
+           lightRadius->set_paddingY(15.0f);
+           
+           lightColor = new TextField("RGB:", "", TextFieldFilters::characters);
+           lightColor->set_size(60.0f, 15.0f);
+           lightColor->set_paddingX(25.0f);
+           
            projectName = new TextField("Name:", "", TextFieldFilters::characters);
            projectName->set_size(80.0f, 25.0f);
            projectName->set_labelPaddingX(15.0f);
            
            Button *button4 = new Button("Apply", [](){
-                  float px, py, pz, sclX, sclY, sclZ;
-                  px = py = pz = 0.0f;
-                  sclX = sclY = sclZ = 1.0f;
+                  std::vector<SceneObject*> &selection = Variables::scene->get_selection();
                   
-                  if (x->get_text().length() > 0) px = std::stof(x->get_text());
-                  if (y->get_text().length() > 0) py = std::stof(y->get_text());
-                  if (z->get_text().length() > 0) pz = std::stof(z->get_text());
-                 
-                  if (scalingX->get_text().length() > 0) sclX = std::stof(scalingX->get_text());
-                  if (scalingY->get_text().length() > 0) sclY = std::stof(scalingY->get_text());
-                  if (scalingZ->get_text().length() > 0) sclZ = std::stof(scalingZ->get_text());
-                 
-                  SceneObject *selected = Variables::scene->get_selected();
-                  if (selected != nullptr) {
-                      selected->set_position(px, py, pz);
-                      selected->set_scaling(sclX, sclY, sclZ);
+                  // With several objects selected, empty fields keep each object's own values
+                  bool bulk = selection.size() > 1;
+                  for (auto &selected : selection) {
+                      Vec3f position = bulk ? selected->position : Vec3f(0.0f, 0.0f, 0.0f);
+                      Vec3f scaling = bulk ? selected->scaling : Vec3f(1.0f, 1.0f, 1.0f);
+                      
+                      if (x->get_text().length() > 0) position.x = std::stof(x->get_text());
+                      if (y->get_text().length() > 0) position.y = std::stof(y->get_text());
+                      if (z->get_text().length() > 0) position.z = std::stof(z->get_text());
+                     
+                      if (scalingX->get_text().length() > 0) scaling.x = std::stof(scalingX->get_text());
+                      if (scalingY->get_text().length() > 0) scaling.y = std::stof(scalingY->get_text());
+                      if (scalingZ->get_text().length() > 0) scaling.z = std::stof(scalingZ->get_text());
+                      
+                      selected->set_position(position);
+                      selected->set_scaling(scaling);
+                      
+                      Light *light = selected->get_light();
+                      if (light == nullptr) continue;
+                      
+                      Vec3f color;
+                      if (sscanf(lightColor->get_text().c_str(), "%f%*[ ,]%f%*[ ,]%f", &color.x, &color.y, &color.z) == 3) light->color = color;
+                      if (lightRadius->get_text().length() > 0) light->radius = std::max(std::stof(lightRadius->get_text()), 0.01f);
+                      
+                      // The marker takes the light's color
+                      selected->set_color(light->color);
                   }
            });
            button4->set_size(150.0f, 25.0f);
            
            Button *button5 = new Button("Remove", [](){
-                  SceneObject *selected = Variables::scene->get_selected();
-                  if (selected != nullptr) {
-                       Variables::scene->remove_object(selected);
-                       Variables::scene->set_selected(nullptr);
-                  }
+                  std::vector<SceneObject*> selection = Variables::scene->get_selection();
+                  Variables::scene->remove_objects(selection);
+                  Variables::scene->set_selected(nullptr);
            });
            button5->set_size(100.0f, 25.0f);
            
@@ -2408,11 +6132,14 @@ namespace UI {
            
            
            meshesTable->add_object(button);
+           meshesTable->add_object(lightButton);
            meshesTable->add_object(button2);
+           meshesTable->add_object(snapButton);
            
            propertiesTable->add_object(x);
            propertiesTable->add_object(y);
            propertiesTable->add_object(z);
+           propertiesTable->add_object(lightRadius);
            propertiesTable->add_object(button4);
            propertiesTable->add_object(button3);
            propertiesTable->add_object(button5);
@@ -2421,6 +6148,7 @@ namespace UI {
            propertiesTable->add_object(scalingX);
            propertiesTable->add_object(scalingY);
            propertiesTable->add_object(scalingZ);
+           propertiesTable->add_object(lightColor);
            
            projectTable->add_object(projectName);
            projectTable->add_object(button6);
@@ -2436,7 +6164,51 @@ namespace UI {
            });
            
            add(positionLabel);
+           
+           cullingLabel = new Label();
+           cullingLabel->update([](){
+                Scene *scene = Variables::scene;
+                cullingLabel->set_text("Culled: " + std::to_string(scene->get_culled_count()) + " / " + std::to_string(scene->get_objects().size()) +
+                                       " (occluded " + std::to_string(scene->get_occluded_count()) + ")");
+                cullingLabel->set_position(0.32f * SCREEN_WIDTH, 0.42f * SCREEN_HEIGHT);
+           });
+           
+           add(cullingLabel);
+           
+           streamingLabel = new Label();
+           streamingLabel->update([](){
+                streamingLabel->set_text("Streamed: " + std::to_string(StreamBuffer::bytes_last_frame() / 1024) + " KB / frame");
+                streamingLabel->set_position(-0.32f * SCREEN_WIDTH, -0.46f * SCREEN_HEIGHT);
+           });
+           
+           add(streamingLabel);
+     }
+     // Whether the point is over a widget or a table, in which case it shouldn't start a marquee
+     bool over_widget(float mx, float my) {
+           for (auto &object : uiObjects) {
+                if (object->is_visible() && object->can_focus(mx, my)) return true;
+           }
+           return meshesTable->point_inside(mx, my) || propertiesTable->point_inside(mx, my) || projectTable->point_inside(mx, my);
+     }
+     void handle_box_select(SDL_Event event, float mx, float my) {
+           if (event.type == SDL_MOUSEBUTTONDOWN && !over_widget(mx, my)) {
+                boxSelecting = true;
+                boxStart = boxEnd = Vec2f(mx, my);
+           }
+           if (!boxSelecting) return;
+           
+           if (event.type == SDL_MOUSEMOTION) {
+                boxEnd = Vec2f(mx, my);
+           }
+           if (event.type == SDL_MOUSEBUTTONUP) {
+                boxEnd = Vec2f(mx, my);
+                boxSelecting = false;
+                
+                float halfWidth = SCREEN_WIDTH / 2.0f, halfHeight = SCREEN_HEIGHT / 2.0f;
+                Variables::scene->select_rectangle(Variables::camera, boxStart.x / halfWidth, boxStart.y / halfHeight, boxEnd.x / halfWidth, boxEnd.y / halfHeight);
+           }
      }
+     
      void handle_event(SDL_Event event, float timeTook) {
            int cx, cy;
            SDL_GetMouseState(&cx, &cy);
@@ -2486,6 +6258,10 @@ namespace UI {
            meshesTable->handle_event(event, timeTook);
            propertiesTable->handle_event(event, timeTook);
            projectTable->handle_event(event, timeTook);
+           
+           if (TemporarySettings::boxSelect) {
+                handle_box_select(event, mx, my);
+           }
      }
      void update() {
            for (auto &object : uiObjects) {
@@ -2498,10 +6274,8 @@ namespace UI {
            propertiesTable->update();
            projectTable->update();
      }
-     void render() {
+     void draw() {
            glDisable(GL_DEPTH_TEST);
-           Renderer::overlayShader->use();
-           Renderer::overlayShader->set_uniform_mat4("projection", projection);
            
            for (auto &object : uiObjects) {
                 if (!object->is_visible()) continue;
@@ -2512,15 +6286,26 @@ namespace UI {
            propertiesTable->render();
            projectTable->render();
            
-           Renderer::overlayShader->set_uniform_bool("renderingText", false);
-           Renderer::atlas->use();
-           Renderer::uiBatch->render();
+           if (boxSelecting) {
+                // Marquee border
+                float x1 = std::min(boxStart.x, boxEnd.x), x2 = std::max(boxStart.x, boxEnd.x);
+                float y1 = std::min(boxStart.y, boxEnd.y), y2 = std::max(boxStart.y, boxEnd.y);
+                float cx = (x1 + x2) / 2.0f, cy = (y1 + y2) / 2.0f;
+                Renderer::draw_rectangle("button-background", cx, y1, x2 - x1, 2.0f, UIPallete::checkboxHovered);
+                Renderer::draw_rectangle("button-background", cx, y2, x2 - x1, 2.0f, UIPallete::checkboxHovered);
+                Renderer::draw_rectangle("button-background", x1, cy, 2.0f, y2 - y1, UIPallete::checkboxHovered);
+                Renderer::draw_rectangle("button-background", x2, cy, 2.0f, y2 - y1, UIPallete::checkboxHovered);
+           }
            
-           Renderer::overlayShader->set_uniform_bool("renderingText", true);
-           Renderer::textAtlas->use();
+           Renderer::uiBatch->render();
            Renderer::textBatch->render();
            glEnable(GL_DEPTH_TEST);
      }
+     // The whole overlay is one item of the last pass. Its batches may draw early when their
+     // streams fill up, so the geometry is built when the item runs rather than when it's submitted.
+     void render(RenderQueue *queue) {
+           queue->submit(RenderPasses::overlay, Renderer::overlayShader, 0, draw);
+     }
 };
 
 class Game
@@ -2543,6 +6328,8 @@ class Modeling : public Game {
            displayName = "Modeling";
        }
        void load() override {
+           Uint64 start = SDL_GetPerformanceCounter();
+           
            TemporarySettings::load();
            UIPallete::load();
            FreeType::get().load();
@@ -2550,23 +6337,40 @@ class Modeling : public Game {
            UI::load();
                     
            Variables::load();
+           
+           double loadTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+           printf("Loaded in %.1f ms, %d programs from the shader cache, %d compiled\n", loadTime * 1000.0, Shader::cache_hits(), Shader::cache_misses());
        }
        void handle_event(SDL_Event ev, float timeTook) override {
            UI::focused = false;
            UI::handle_event(ev, timeTook);
-           if (!UI::focused) {
+           if (!UI::focused && !TemporarySettings::boxSelect) {
                Variables::controls->handle_event(ev, timeTook);
            }
+           if (ev.type == SDL_MOUSEMOTION && TemporarySettings::snapMode != SnapModes::none) {
+               UI::update_preview();
+           }
        }
        void update(float timeTook) override {
+           Timing::begin("ui update");
            UI::update();
+           Timing::end();
            
            Variables::camera->update();
            Variables::scene->update(timeTook);
+           Renderer::begin_frame(Variables::camera);
            
-           Variables::scene->render(Variables::camera);
+           Variables::scene->render(Variables::camera, Variables::renderQueue);
+           UI::render(Variables::renderQueue);
+           Variables::renderQueue->render();
            
-           UI::render();
+           if (TemporarySettings::hoverHighlight) {
+               int mx = 0, my = 0, w = 0, h = 0;
+               SDL_GetMouseState(&mx, &my);
+               SDL_GetWindowSize(windows, &w, &h);
+               Variables::scene->render_ids(Variables::camera, (float) mx / w, 1.0f - (float) my / h);
+           }
+           StreamBuffer::end_frame();
        }
        
        void dispose() override {
@@ -2576,8 +6380,777 @@ class Modeling : public Game {
        }
 };
 
-int main()
+namespace Benchmarks {
+     // Casts a grid of camera rays into 10k random boxes, one at a time and in packets of 4, 8 and
+     // 16 neighbouring pixels, with every kernel set available, and checks the paths agree
+     int ray_packets() {
+          const int objectCount = 10000;
+          const int resolution = 512;
+          const float maxLength = 1000.0f;
+          
+          srand(1);
+          auto random = []() { return (float) rand() / RAND_MAX; };
+          std::vector<AABB> bounds;
+          for (int i = 0; i < objectCount; i++) {
+               Vec3f center = Vec3f((random() - 0.5f) * 200.0f, (random() - 0.5f) * 200.0f, -5.0f - random() * 200.0f);
+               float half = 0.25f + random() * 1.5f;
+               bounds.push_back(AABB(Vec3f(center).sub(Vec3f(half, half, half)), Vec3f(center).add(Vec3f(half, half, half))));
+          }
+          BVH tree;
+          tree.build(bounds);
+          
+          // A 90 degree view from the origin looking down -z
+          Vec3f origin = Vec3f(0.0f, 0.0f, 0.0f);
+          auto direction_of = [&](int x, int y) {
+               return Vec3f((x + 0.5f) / resolution * 2.0f - 1.0f, (y + 0.5f) / resolution * 2.0f - 1.0f, -1.0f).norm();
+          };
+          
+          std::vector<int> expected(resolution * resolution, -1);
+          Uint64 start = SDL_GetPerformanceCounter();
+          for (int y = 0; y < resolution; y++) {
+               for (int x = 0; x < resolution; x++) {
+                    Vec3f direction = direction_of(x, y);
+                    float nearest = maxLength;
+                    int hit = -1;
+                    tree.traverse_ray(origin, direction, nearest, [&](int primitive, float &maxLength) {
+                         float distance = 0.0f;
+                         if (bounds[primitive].intersect_ray(origin, direction, maxLength, distance)) {
+                              maxLength = distance;
+                              hit = primitive;
+                         }
+                    });
+                    expected[y * resolution + x] = hit;
+               }
+          }
+          double scalarTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+          
+          int rayCount = resolution * resolution;
+          printf("%d objects, %d rays\n", objectCount, rayCount);
+          printf("single rays:        %8.2f ms  %6.1f ns/ray\n", scalarTime * 1000.0, scalarTime * 1e9 / rayCount);
+          
+          std::vector<std::function<bool()>> kernels = {
+               []() { PacketKernels::use_scalar(); return true; },
+               PacketKernels::use_sse,
+               PacketKernels::use_avx2
+          };
+          alignas(32) float entry[RayPacket::maxSize];
+          int failures = 0;
+          for (auto &use : kernels) {
+               if (!use()) continue;
+               
+               for (int packetSize = 4; packetSize <= RayPacket::maxSize; packetSize *= 2) {
+                    // Square-ish tiles of pixels, so the rays in a packet stay close together
+                    int tileWidth = packetSize == 8 ? 4 : (int) sqrt(packetSize);
+                    int tileHeight = packetSize / tileWidth;
+                    int mismatches = 0;
+                    
+                    RayPacket packet;
+                    start = SDL_GetPerformanceCounter();
+                    for (int y = 0; y < resolution; y += tileHeight) {
+                         for (int x = 0; x < resolution; x += tileWidth) {
+                              packet.clear();
+                              for (int ty = 0; ty < tileHeight; ty++) {
+                                   for (int tx = 0; tx < tileWidth; tx++) {
+                                        packet.add(origin, direction_of(x + tx, y + ty), maxLength);
+                                   }
+                              }
+                              tree.traverse_packet(packet, [&](int primitive) {
+                                   int mask = PacketKernels::intersect_box(packet, bounds[primitive], entry);
+                                   for (int i = 0; mask != 0; i++, mask >>= 1) {
+                                        if (!(mask & 1)) continue;
+                                        packet.maxLength[i] = entry[i];
+                                        packet.hit[i] = primitive;
+                                   }
+                              });
+                              
+                              for (int i = 0; i < packet.size; i++) {
+                                   int pixel = (y + i / tileWidth) * resolution + x + i % tileWidth;
+                                   if (packet.hit[i] != expected[pixel]) mismatches++;
+                              }
+                         }
+                    }
+                    double packetTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+                    
+                    printf("%-6s packets of %2d: %8.2f ms  %6.1f ns/ray  %.2fx  %d mismatches\n", PacketKernels::name, packetSize,
+                           packetTime * 1000.0, packetTime * 1e9 / rayCount, scalarTime / packetTime, mismatches);
+                    if (mismatches > 0) failures++;
+               }
+          }
+          PacketKernels::select();
+          
+          return failures == 0 ? 0 : 1;
+     }
+     
+     // Checks OcclusionBuffer without a GL context: a box right behind a wall is hidden, boxes
+     // peeking past its edges by less than a texel are kept, and the SSE2 and scalar paths fill
+     // the same buffer. Then times both paths on 16 cube occluders, as the scene uses.
+     int occlusion() {
+          int failures = 0;
+          auto check = [&](bool passed, const char *what) {
+               printf("%-44s %s\n", what, passed ? "ok" : "FAILED");
+               if (!passed) failures++;
+          };
+          
+          // With an identity view-projection, x and y from -1 to 1 span the buffer and z maps to depth
+          auto at_x = [](float texel) { return texel / OcclusionBuffer::width * 2.0f - 1.0f; };
+          auto at_y = [](float texel) { return texel / OcclusionBuffer::height * 2.0f - 1.0f; };
+          
+          // A wall at depth 0.5. Its right and top edges pass the centers of texels 160 and 96, so
+          // sampling texel centers alone would count that whole column and row as covered.
+          float left = at_x(64.0f), right = at_x(160.7f), bottom = at_y(32.0f), top = at_y(96.7f);
+          RenderVertices wall = {
+               RenderVertex(left, bottom, 0.0f,  0.0f, 0.0f, 1.0f),
+               RenderVertex(right, bottom, 0.0f,  0.0f, 0.0f, 1.0f),
+               RenderVertex(right, top, 0.0f,  0.0f, 0.0f, 1.0f),
+               RenderVertex(left, top, 0.0f,  0.0f, 0.0f, 1.0f)
+          };
+          RenderIndices wallIndices = { 0, 1, 2, 0, 2, 3 };
+          Vec3f unscaled = Vec3f(1.0f, 1.0f, 1.0f), origin = Vec3f(0.0f, 0.0f, 0.0f);
+          
+          OcclusionBuffer buffer;
+          buffer.begin(Mat4x4());
+          buffer.add_occluder(wall, wallIndices, unscaled, origin);
+          buffer.build_hierarchy();
+          
+          check(buffer.is_occluded(AABB(Vec3f(at_x(100.0f), at_y(50.0f), 0.2f), Vec3f(at_x(150.0f), at_y(80.0f), 0.4f))),
+                "box behind the wall is occluded");
+          check(!buffer.is_occluded(AABB(Vec3f(at_x(100.0f), at_y(50.0f), -0.4f), Vec3f(at_x(150.0f), at_y(80.0f), -0.2f))),
+                "box in front of the wall is kept");
+          
+          // Small enough to be tested against the full resolution level, where coarser levels would hide the edge
+          check(!buffer.is_occluded(AABB(Vec3f(at_x(159.5f), at_y(60.2f), 0.2f), Vec3f(at_x(160.9f), at_y(60.8f), 0.4f))),
+                "box peeking past the right edge is kept");
+          check(!buffer.is_occluded(AABB(Vec3f(at_x(100.2f), at_y(95.5f), 0.2f), Vec3f(at_x(100.8f), at_y(96.9f), 0.4f))),
+                "box peeking past the top edge is kept");
+          check(buffer.is_occluded(AABB(Vec3f(at_x(159.1f), at_y(60.2f), 0.2f), Vec3f(at_x(159.9f), at_y(60.8f), 0.4f))),
+                "small box just inside the edge is occluded");
+          
+          // Concave occluders, built from flat quads at depth 0.5
+          auto add_quad = [&](RenderVertices &vertices, RenderIndices &indices, float x1, float y1, float x2, float y2) {
+               unsigned int first = vertices.size();
+               vertices.push_back(RenderVertex(at_x(x1), at_y(y1), 0.0f,  0.0f, 0.0f, 1.0f));
+               vertices.push_back(RenderVertex(at_x(x2), at_y(y1), 0.0f,  0.0f, 0.0f, 1.0f));
+               vertices.push_back(RenderVertex(at_x(x2), at_y(y2), 0.0f,  0.0f, 0.0f, 1.0f));
+               vertices.push_back(RenderVertex(at_x(x1), at_y(y2), 0.0f,  0.0f, 0.0f, 1.0f));
+               for (unsigned int index : { 0, 1, 2, 0, 2, 3 }) indices.push_back(first + index);
+          };
+          
+          // A U shape whose notch is 32 texels wide. The arms overlap the base so no texel corner
+          // falls on a shared edge.
+          RenderVertices notched;
+          RenderIndices notchedIndices;
+          add_quad(notched, notchedIndices, 32.0f, 20.0f, 128.0f, 40.5f);
+          add_quad(notched, notchedIndices, 32.0f, 40.0f, 64.0f, 96.0f);
+          add_quad(notched, notchedIndices, 96.0f, 40.0f, 128.0f, 96.0f);
+          buffer.begin(Mat4x4());
+          buffer.add_occluder(notched, notchedIndices, unscaled, origin);
+          buffer.build_hierarchy();
+          check(!buffer.is_occluded(AABB(Vec3f(at_x(70.0f), at_y(60.0f), 0.2f), Vec3f(at_x(90.0f), at_y(80.0f), 0.4f))),
+                "box seen through a wide notch is kept");
+          check(buffer.is_occluded(AABB(Vec3f(at_x(40.0f), at_y(50.0f), 0.2f), Vec3f(at_x(60.0f), at_y(80.0f), 0.4f))),
+                "box behind an arm of the notch is occluded");
+          
+          // Two quads with a slit between x 150.3 and 150.6, inside the column of texel 150. The
+          // texel's corners are covered on both sides, so the known limit is that the slit is lost.
+          RenderVertices slit;
+          RenderIndices slitIndices;
+          add_quad(slit, slitIndices, 140.2f, 32.0f, 150.3f, 96.0f);
+          add_quad(slit, slitIndices, 150.6f, 32.0f, 170.0f, 96.0f);
+          buffer.begin(Mat4x4());
+          buffer.add_occluder(slit, slitIndices, unscaled, origin);
+          buffer.build_hierarchy();
+          check(buffer.is_occluded(AABB(Vec3f(at_x(150.35f), at_y(60.2f), 0.2f), Vec3f(at_x(150.55f), at_y(60.8f), 0.4f))),
+                "box seen through a sub-texel slit is culled");
+          
+          // 16 cubes of different sizes in front of a slightly turned camera, so edges run at all angles
+          Camera camera;
+          camera.position = Vec3f(0.0f, 1.5f, 0.0f);
+          camera.rotationX = 0.3f;
+          camera.rotationY = -0.1f;
+          camera.update();
+          std::vector<std::pair<Vec3f, Vec3f>> cubes;
+          for (int i = 0; i < 16; i++) {
+               Vec3f position = Vec3f(4.0f + i * 1.5f, 0.5f * (i % 3), (i % 4 - 1.5f) * 2.5f + i * 0.4f);
+               cubes.push_back(std::make_pair(Vec3f(1.0f + 0.5f * (i % 2), 1.0f + (i % 3), 1.0f + 0.25f * (i % 4)), position));
+          }
+          
+          OcclusionBuffer paths[2];
+          paths[1].set_vectorized(false);
+          double times[2];
+          const int frames = 1000;
+          for (int path = 0; path < 2; path++) {
+               Uint64 start = SDL_GetPerformanceCounter();
+               for (int frame = 0; frame < frames; frame++) {
+                    paths[path].begin(camera.get_combined());
+                    for (auto &cube : cubes) {
+                         paths[path].add_occluder(BaseMeshes::cubeVertices, BaseMeshes::cubeIndices, cube.first, cube.second);
+                    }
+                    paths[path].build_hierarchy();
+               }
+               times[path] = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() / frames;
+          }
+          
+          // The paths could only differ by rounding if the compiler fuses a multiply and add in one of them
+          int mismatches = 0, covered = 0;
+          for (int level = 0; level < paths[0].get_level_count(); level++) {
+               std::vector<float> &a = paths[0].get_level(level), &b = paths[1].get_level(level);
+               for (int i = 0; i < (int) a.size(); i++) {
+                    if (fabs(a[i] - b[i]) > 1e-6f) mismatches++;
+                    if (level == 0 && a[i] < 1.0f) covered++;
+               }
+          }
+          printf("%d of %d texels covered by the cubes, %d mismatches\n", covered, OcclusionBuffer::width * OcclusionBuffer::height, mismatches);
+          check(covered > 0 && mismatches == 0, "SSE2 and scalar paths give the same buffer");
+          
+#if defined(__SSE2__)
+          printf("16 cube occluders and levels: SSE2 %.3f ms, scalar %.3f ms\n", times[0] * 1000.0, times[1] * 1000.0);
+#else
+          printf("16 cube occluders and levels: %.3f ms (SSE2 not compiled in)\n", times[1] * 1000.0);
+#endif
+          return failures == 0 ? 0 : 1;
+     }
+     
+     // A unit sphere of 2 * segments^2 triangles, standing in for a large imported mesh
+     void dense_sphere(int segments, RenderVertices &vertices, RenderIndices &indices) {
+          for (int i = 0; i <= segments; i++) {
+               for (int j = 0; j <= segments; j++) {
+                    float theta = M_PI * i / segments, phi = 2.0f * M_PI * j / segments;
+                    Vec3f normal = Vec3f(sinf(theta) * cosf(phi), cosf(theta), sinf(theta) * sinf(phi));
+                    vertices.push_back(RenderVertex(normal, Vec3f(0.5f + 0.5f * normal.x, 0.5f + 0.5f * normal.y, 0.8f), normal));
+               }
+          }
+          for (int i = 0; i < segments; i++) {
+               for (int j = 0; j < segments; j++) {
+                    uint a = i * (segments + 1) + j, b = a + 1, c = a + segments + 1, d = c + 1;
+                    indices.insert(indices.end(), { a, c, b, b, c, d });
+               }
+          }
+     }
+     
+     // What the drawing benchmarks share: a default camera, the object shader with its fixed light
+     // and no point lights, and a queue to draw with. Needs a GL context.
+     struct DrawSetup {
+          Camera camera;
+          Shader shader = Shader("model.vert", "model.frag");
+          RenderQueue queue;
+          LightClusters lights;
+          
+          DrawSetup() {
+               camera.update();
+               Renderer::cameraBuffer = new UniformBuffer(CameraBlock::binding, sizeof(CameraBlock));
+               Renderer::begin_frame(&camera);
+               
+               shader.use();
+               shader.set_uniform_vec3f("lightPosition", -2.0f, 3.0f, 2.0f);
+               lights.upload(&camera);
+               lights.bind(&shader);
+          }
+          void dispose() {
+               shader.clear();
+               queue.dispose();
+               lights.dispose();
+               Renderer::cameraBuffer->dispose();
+               delete Renderer::cameraBuffer;
+               Renderer::cameraBuffer = nullptr;
+          }
+     };
+     
+     // Draws a dense sphere from full and compact vertices. Reports the memory each takes, how long
+     // drawing it takes, the precision lost, and how many pixels of the two images differ.
+     // Needs a GL context.
+     int vertex_formats() {
+          const int segments = 512;
+          const int instances = 9;
+          const int frames = 10;
+          
+          RenderVertices vertices;
+          RenderIndices indices;
+          dense_sphere(segments, vertices, indices);
+          printf("%d vertices, %d triangles, %d instances, %d frames\n", (int) vertices.size(), (int) indices.size() / 3, instances, frames);
+          
+          DrawSetup setup;
+          Shader &shader = setup.shader;
+          RenderQueue &queue = setup.queue;
+          
+          VertexFormats formats[] = { VertexFormats::full, VertexFormats::compact };
+          const char *names[] = { "full", "compact" };
+          std::vector<unsigned char> images[2];
+          for (int f = 0; f < 2; f++) {
+               Mesh mesh = Mesh(vertices, indices).set_vertex_format(formats[f]);
+               
+               Uint64 start = SDL_GetPerformanceCounter();
+               MeshBuffer *buffer = mesh.get_buffer();
+               glFinish();
+               double uploadTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+               
+               std::vector<SceneObject*> objects;
+               for (int i = 0; i < instances; i++) {
+                    SceneObject *object = new SceneObject(mesh);
+                    object->set_position(6.0f, (i / 3 - 1) * 2.2f, (i % 3 - 1) * 2.2f);
+                    objects.push_back(object);
+               }
+               
+               start = SDL_GetPerformanceCounter();
+               for (int frame = 0; frame < frames; frame++) {
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    for (auto &object : objects) {
+                         object->render(&queue, &shader, 0.0f);
+                    }
+                    queue.render();
+               }
+               glFinish();
+               double drawTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+               
+               images[f].resize(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+               glReadPixels(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, images[f].data());
+               
+               printf("%-8s %2d B/vertex  %7.2f MB of vertices (+ %.2f MB of indices)  upload %7.2f ms  draw %7.2f ms/frame\n", names[f],
+                      VertexAttributes::stride(formats[f]), buffer->get_vertex_bytes() / 1048576.0, indices.size() * sizeof(uint) / 1048576.0,
+                      uploadTime * 1000.0, drawTime * 1000.0 / frames);
+               
+               for (auto &object : objects) {
+                    delete object;
+               }
+               mesh.dispose();
+          }
+          
+          // What quantizing costs in precision, measured the way the shader decodes it
+          AABB bounds = Mesh(vertices, indices).get_bounds();
+          Vec3f extent = Vec3f(bounds.max).sub(bounds.min);
+          float positionError = 0.0f, normalError = 0.0f;
+          for (auto &vertex : vertices) {
+               CompactVertex packed = CompactVertex(vertex, bounds.min, extent);
+               Vec3f decoded = Vec3f(packed.Position[0] / 65535.0f, packed.Position[1] / 65535.0f, packed.Position[2] / 65535.0f).mul(extent).add(bounds.min);
+               positionError = std::max(positionError, decoded.sub(vertex.Position).len());
+               
+               auto component = [&](int shift) -> float {
+                    int value = (packed.Normal >> shift) & 0x3FF;
+                    if (value & 0x200) value -= 0x400;
+                    return std::max(value / 511.0f, -1.0f);
+               };
+               Vec3f normal = Vec3f(component(0), component(10), component(20)).mul(Vec3f(1.0f / extent.x, 1.0f / extent.y, 1.0f / extent.z)).norm();
+               Vec3f original = vertex.Normal;
+               normalError = std::max(normalError, acosf(std::min(normal.dot_prod(original), 1.0f)) * 180.0f / (float) M_PI);
+          }
+          int differing = 0;
+          for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+               for (int c = 0; c < 3; c++) {
+                    if (abs(images[0][i * 4 + c] - images[1][i * 4 + c]) > 2) {
+                         differing++;
+                         break;
+                    }
+               }
+          }
+          printf("max position error %.6f (%.5f%% of the mesh size), max normal error %.3f degrees, %d of %d pixels differ\n",
+                 positionError, positionError / extent.len() * 100.0f, normalError, differing, SCREEN_WIDTH * SCREEN_HEIGHT);
+          
+          setup.dispose();
+          return 0;
+     }
+     
+     // Generates the levels of detail of a 2M triangle sphere, then draws a row of copies going
+     // away from the camera with and without them. Reports the levels, the triangles and time
+     // each frame takes, how many pixels differ, and how many levels change while the camera
+     // sways around a fixed point. Needs a GL context.
+     int detail_levels() {
+          const int segments = 1024;
+          const int instances = 16;
+          const int frames = 10;
+          const float maxError = 1.0f;
+          
+          RenderVertices vertices;
+          RenderIndices indices;
+          dense_sphere(segments, vertices, indices);
+          
+          Uint64 start = SDL_GetPerformanceCounter();
+          Mesh mesh = Mesh(vertices, indices).set_detail_levels(8);
+          double generationTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+          printf("generated %d levels in %.1f ms\n", mesh.detail_level_count(), generationTime * 1000.0);
+          for (int level = 0; level < mesh.detail_level_count(); level++) {
+               printf("  level %d: %8d triangles, error %.4f of the mesh size\n", level, mesh.triangle_count(level), mesh.detail_error(level));
+          }
+          
+          DrawSetup setup;
+          Camera &camera = setup.camera;
+          Shader &shader = setup.shader;
+          RenderQueue &queue = setup.queue;
+          
+          // The camera looks down +x, and each copy is further away than the last
+          std::vector<SceneObject*> objects;
+          float distance = 3.0f;
+          for (int i = 0; i < instances; i++) {
+               SceneObject *object = new SceneObject(mesh);
+               object->set_position(distance, (i % 4 - 1.5f) * distance * 0.3f, (i / 4 % 2 - 0.5f) * distance * 0.3f);
+               objects.push_back(object);
+               distance *= 1.4f;
+          }
+          
+          const char *names[] = { "full", "detail" };
+          std::vector<unsigned char> images[2];
+          for (int pass = 0; pass < 2; pass++) {
+               int triangles = 0;
+               start = SDL_GetPerformanceCounter();
+               for (int frame = 0; frame < frames; frame++) {
+                    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+                    triangles = 0;
+                    for (auto &object : objects) {
+                         object->select_detail(&camera, pass == 0 ? 0.0f : maxError);
+                         object->render(&queue, &shader, 0.0f);
+                         triangles += mesh.triangle_count(object->get_detail_level());
+                    }
+                    queue.render();
+               }
+               glFinish();
+               double drawTime = (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+               
+               images[pass].resize(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+               glReadPixels(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, images[pass].data());
+               
+               printf("%-8s %9d triangles  %2d draw calls  draw %7.2f ms/frame  levels", names[pass], triangles, queue.get_draw_calls(), drawTime * 1000.0 / frames);
+               for (auto &object : objects) {
+                    printf(" %d", object->get_detail_level());
+               }
+               printf("\n");
+          }
+          
+          int differing = 0;
+          for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+               for (int c = 0; c < 3; c++) {
+                    if (abs(images[0][i * 4 + c] - images[1][i * 4 + c]) > 8) {
+                         differing++;
+                         break;
+                    }
+               }
+          }
+          printf("%d of %d pixels differ\n", differing, SCREEN_WIDTH * SCREEN_HEIGHT);
+          
+          // Swaying by a fraction of a unit should not make levels flicker
+          int changes = 0;
+          for (int step = 0; step < 100; step++) {
+               camera.position.x = 0.05f * sinf(step * 0.5f);
+               for (auto &object : objects) {
+                    int before = object->get_detail_level();
+                    object->select_detail(&camera, maxError);
+                    if (object->get_detail_level() != before) changes++;
+               }
+          }
+          printf("%d level changes while swaying over 100 steps\n", changes);
+          
+          for (auto &object : objects) {
+               delete object;
+          }
+          mesh.dispose();
+          setup.dispose();
+          return 0;
+     }
+};
+
+// State every context starts with, windowed or not
+void set_default_gl_state() {
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glEnable(GL_BLEND);
+    
+    glDepthFunc(GL_LESS);
+    glPolygonOffset(1, 0);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+}
+
+// Renders the scene without a window, into an offscreen framebuffer of an EGL context that needs
+// no display server. Under Mesa that runs on llvmpipe, so the build and farm machines can render
+// and time frames too.
+//   --headless [--size WxH] [--frames N] [--cubes N] [--lights N] [--light-radius R] [--compare-lights] [--camera x,y,z,yaw,pitch] [--output prefix] [--no-output] [--serial]
+// Angles are in degrees. Every frame is written to <prefix>_NNNN.png. --serial keeps the scene
+// preparation off the thread pool.
+namespace Headless {
+     struct Options {
+          int width = SCREEN_WIDTH, height = SCREEN_HEIGHT;
+          int frames = 1;
+          int cubes = 0;
+          int lights = 0;
+          float lightRadius = 4.0f;
+          bool compareLights = false;
+          Vec3f position = Vec3f(1.0f, 1.0f, 1.0f);
+          float yaw = 0.0f, pitch = 0.0f;
+          std::string output = "frame";
+          bool writeImages = true;
+          bool serial = false;
+     };
+     
+     bool parse(int argc, char *argv[], Options &options) {
+          for (int i = 2; i < argc; i++) {
+               std::string option = argv[i];
+               bool hasValue = i + 1 < argc;
+               if (option == "--no-output") {
+                    options.writeImages = false;
+               } else if (option == "--serial") {
+                    options.serial = true;
+               } else if (option == "--size" && hasValue) {
+                    if (sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2) return false;
+               } else if (option == "--frames" && hasValue) {
+                    options.frames = atoi(argv[++i]);
+               } else if (option == "--cubes" && hasValue) {
+                    options.cubes = atoi(argv[++i]);
+               } else if (option == "--lights" && hasValue) {
+                    options.lights = atoi(argv[++i]);
+               } else if (option == "--light-radius" && hasValue) {
+                    options.lightRadius = atof(argv[++i]);
+               } else if (option == "--compare-lights") {
+                    options.compareLights = true;
+               } else if (option == "--camera" && hasValue) {
+                    Vec3f &p = options.position;
+                    if (sscanf(argv[++i], "%f,%f,%f,%f,%f", &p.x, &p.y, &p.z, &options.yaw, &options.pitch) != 5) return false;
+               } else if (option == "--output" && hasValue) {
+                    options.output = argv[++i];
+               } else {
+                    fprintf(stderr, "Unknown or incomplete option %s\n", argv[i]);
+                    return false;
+               }
+          }
+          return options.width > 0 && options.height > 0 && options.frames > 0;
+     }
+     
+     EGLDisplay display = EGL_NO_DISPLAY;
+     EGLContext context = EGL_NO_CONTEXT;
+     EGLSurface surface = EGL_NO_SURFACE;
+     
+     bool create_context(int width, int height) {
+          // Mesa's surfaceless platform needs neither a display server nor a GPU
+          const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+          auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+          if (clientExtensions != NULL && strstr(clientExtensions, "EGL_MESA_platform_surfaceless") && getPlatformDisplay != NULL) {
+               display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+          }
+          if (display == EGL_NO_DISPLAY) {
+               display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+          }
+          if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+               fprintf(stderr, "Couldn't initialize EGL: 0x%x\n", eglGetError());
+               return false;
+          }
+          eglBindAPI(EGL_OPENGL_ES_API);
+          
+          const EGLint configAttributes[] = {
+               EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+               EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+               EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+               EGL_NONE
+          };
+          EGLConfig config;
+          EGLint configCount = 0;
+          if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+               fprintf(stderr, "No EGL config for OpenGL ES 3\n");
+               return false;
+          }
+          const EGLint contextAttributes[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_NONE };
+          context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+          if (context == EGL_NO_CONTEXT) {
+               fprintf(stderr, "Couldn't create an OpenGL ES 3 context: 0x%x\n", eglGetError());
+               return false;
+          }
+          
+          // Drawing goes to a framebuffer object, so a surface is only made when the context can't go without one
+          const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+          if (extensions == NULL || !strstr(extensions, "EGL_KHR_surfaceless_context")) {
+               const EGLint surfaceAttributes[] = { EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE };
+               surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+          }
+          if (!eglMakeCurrent(display, surface, surface, context)) {
+               fprintf(stderr, "Couldn't make the context current: 0x%x\n", eglGetError());
+               return false;
+          }
+          return true;
+     }
+     void destroy_context() {
+          eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+          if (surface != EGL_NO_SURFACE) eglDestroySurface(display, surface);
+          if (context != EGL_NO_CONTEXT) eglDestroyContext(display, context);
+          eglTerminate(display);
+     }
+     
+     // Writes the bound framebuffer, flipped to put the first row on top
+     bool save_png(const std::string &fileName, int width, int height) {
+          std::vector<unsigned char> pixels(width * height * 4), flipped(width * height * 4);
+          glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+          for (int y = 0; y < height; y++) {
+               memcpy(&flipped[y * width * 4], &pixels[(height - y - 1) * width * 4], width * 4);
+          }
+          
+          SDL_Surface *image = SDL_CreateRGBSurfaceWithFormatFrom(flipped.data(), width, height, 32, width * 4, SDL_PIXELFORMAT_RGBA32);
+          if (image == NULL) {
+               return false;
+          }
+          int result = IMG_SavePNG(image, fileName.c_str());
+          SDL_FreeSurface(image);
+          return result == 0;
+     }
+     
+     int run(int argc, char *argv[]) {
+          Options options;
+          if (!parse(argc, argv, options)) {
+               fprintf(stderr, "Usage: %s --headless [--size WxH] [--frames N] [--cubes N] [--lights N] [--light-radius R] [--compare-lights] [--camera x,y,z,yaw,pitch] [--output prefix] [--no-output] [--serial]\n", argv[0]);
+               return 1;
+          }
+          int width = options.width, height = options.height;
+          if (!create_context(width, height)) {
+               return 1;
+          }
+          printf("%s | %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+          
+          GLuint framebuffer, colorBuffer, depthBuffer;
+          glGenFramebuffers(1, &framebuffer);
+          glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+          
+          glGenRenderbuffers(1, &colorBuffer);
+          glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+          glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+          glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+          
+          glGenRenderbuffers(1, &depthBuffer);
+          glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+          glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+          glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+          if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+               fprintf(stderr, "Offscreen framebuffer incomplete\n");
+               return 1;
+          }
+          glViewport(0, 0, width, height);
+          set_default_gl_state();
+          Timing::load();
+          
+          TemporarySettings::load();
+          TemporarySettings::parallelPreparation = !options.serial;
+          Renderer::load_camera();
+          Variables::load();
+          
+          Camera *camera = Variables::camera;
+          *camera = Camera(90.0f, 0.1f, 1000.0f, (float) width, (float) height, true);
+          camera->position = options.position;
+          camera->rotationX = options.yaw * M_PI / 180.0f;
+          camera->rotationY = options.pitch * M_PI / 180.0f;
+          
+          // A square block of cubes in front of the default camera
+          Scene *scene = Variables::scene;
+          int side = (int) ceilf(sqrtf(options.cubes));
+          for (int i = 0; i < options.cubes; i++) {
+               SceneObject *object = new SceneObject(BaseMeshes::cube);
+               object->set_color(0.8f, 0.8f, 0.8f)->set_position(4.0f + (i / side) * 2.5f, 0.0f, (i % side - side / 2) * 2.5f);
+               scene->add_object(object);
+          }
+          
+          // Colored lights scattered over the block, just above it
+          srand(1);
+          auto random = []() { return (float) rand() / RAND_MAX; };
+          float extent = std::max(side, 1) * 2.5f;
+          for (int i = 0; i < options.lights; i++) {
+               SceneObject *light = new SceneObject(BaseMeshes::cube);
+               Vec3f color = Vec3f(random(), random(), random());
+               light->set_light(Light(Vec3f(color).mul(2.0f), options.lightRadius))->set_color(color)->set_scaling(0.2f, 0.2f, 0.2f);
+               light->set_position(4.0f + random() * extent, 1.0f, (random() - 0.5f) * extent);
+               scene->add_object(light);
+          }
+          
+          auto render_frame = [&](float timeTook) {
+               Uint64 start = SDL_GetPerformanceCounter();
+               Timing::begin_frame();
+               
+               // Other framebuffers, like the picking one, go back to 0 when they're done, which has nothing behind it here
+               glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+               glClearColor(0.4f, 0.5f, 0.9f, 1.0f);
+               glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+               camera->update();
+               scene->update(timeTook);
+               Renderer::begin_frame(camera);
+               scene->render(camera, Variables::renderQueue);
+               Variables::renderQueue->render();
+               StreamBuffer::end_frame();
+               glFinish();
+               Timing::end_frame();
+               
+               return (double) (SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency() * 1000.0;
+          };
+          
+          std::vector<double> times, bruteForceTimes;
+          std::vector<unsigned char> clustered(width * height * 4), bruteForce(width * height * 4);
+          int differing = 0, largestDifference = 0;
+          for (int frame = 0; frame < options.frames; frame++) {
+               double time = render_frame(1.0f / 60.0f);
+               times.push_back(time);
+               printf("frame %4d: %8.3f ms  %d draw calls", frame, time, Variables::renderQueue->get_draw_calls());
+               
+               // The same frame again with every fragment looping over every light, which has to look the same
+               if (options.compareLights) {
+                    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, clustered.data());
+                    TemporarySettings::clusteredLighting = false;
+                    bruteForceTimes.push_back(render_frame(0.0f));
+                    TemporarySettings::clusteredLighting = true;
+                    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, bruteForce.data());
+                    
+                    int pixels = 0;
+                    for (int i = 0; i < width * height; i++) {
+                         int difference = 0;
+                         for (int c = 0; c < 3; c++) difference = std::max(difference, abs(clustered[i * 4 + c] - bruteForce[i * 4 + c]));
+                         if (difference > 0) pixels++;
+                         largestDifference = std::max(largestDifference, difference);
+                    }
+                    differing += pixels;
+                    printf("  every light %8.3f ms, %d pixels differ", bruteForceTimes.back(), pixels);
+               }
+               printf("\n");
+               
+               if (options.writeImages) {
+                    char fileName[32];
+                    snprintf(fileName, sizeof(fileName), "_%04d.png", frame);
+                    if (!save_png(options.output + fileName, width, height)) {
+                         fprintf(stderr, "Couldn't write %s%s: %s\n", options.output.c_str(), fileName, IMG_GetError());
+                    }
+               }
+          }
+          
+          std::vector<double> sorted = times;
+          std::sort(sorted.begin(), sorted.end());
+          double total = 0.0;
+          for (auto &time : times) total += time;
+          auto percentile = [&](double p) { return sorted[std::min((int) (p * sorted.size()), (int) sorted.size() - 1)]; };
+          printf("%d frames at %dx%d, %d objects: avg %.3f ms, p50 %.3f ms, p95 %.3f ms, min %.3f ms, max %.3f ms, %.1f fps\n",
+                 options.frames, width, height, (int) scene->get_objects().size(), total / times.size(),
+                 percentile(0.5), percentile(0.95), sorted.front(), sorted.back(), 1000.0 * times.size() / total);
+          if (options.compareLights) {
+               double bruteForceTotal = 0.0;
+               for (auto &time : bruteForceTimes) bruteForceTotal += time;
+               printf("%d lights: clustered avg %.3f ms, every light avg %.3f ms, %d pixels differ, by up to %d\n",
+                      options.lights, total / times.size(), bruteForceTotal / bruteForceTimes.size(), differing, largestDifference);
+          }
+          for (auto &zone : Timing::zones) {
+               printf("  %s\n", Timing::describe(zone).c_str());
+          }
+          Timing::dispose();
+          
+          Variables::dispose();
+          Renderer::cameraBuffer->dispose();
+          glDeleteRenderbuffers(1, &colorBuffer);
+          glDeleteRenderbuffers(1, &depthBuffer);
+          glDeleteFramebuffers(1, &framebuffer);
+          destroy_context();
+          return differing == 0 ? 0 : 1;
+     }
+};
+
+int main(int argc, char *argv[])
 {
+    PacketKernels::select();
+    if (argc > 1 && strcmp(argv[1], "--benchmark-rays") == 0) {
+        return Benchmarks::ray_packets();
+    }
+    if (argc > 1 && strcmp(argv[1], "--test-occlusion") == 0) {
+        return Benchmarks::occlusion();
+    }
+    if (argc > 1 && strcmp(argv[1], "--headless") == 0) {
+        return Headless::run(argc, argv);
+    }
+    bool benchmarkVertexFormats = (argc > 1 && strcmp(argv[1], "--benchmark-vertex-formats") == 0);
+    bool benchmarkDetailLevels = (argc > 1 && strcmp(argv[1], "--benchmark-detail-levels") == 0);
+    
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0)
 	{
 		fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
@@ -2608,21 +7181,30 @@ int main()
 	SDL_GLContext context = SDL_GL_CreateContext(window);
     windows = window;
     
-    glEnable(GL_DEPTH_TEST);
-    glEnable(GL_POLYGON_OFFSET_FILL);
-    glEnable(GL_BLEND);
+    set_default_gl_state();
+    Timing::load();
     
-    glDepthFunc(GL_LESS);
-    glPolygonOffset(1, 0);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (benchmarkVertexFormats || benchmarkDetailLevels) {
+        int result = benchmarkVertexFormats ? Benchmarks::vertex_formats() : Benchmarks::detail_levels();
+        SDL_GL_DeleteContext(context);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return result;
+    }
     
     game.load();    
     
-	float then = 0.0f, delta = 0.0f;
+	// Seconds since the previous frame
+	Uint64 then = SDL_GetPerformanceCounter();
+	float delta = 0.0f;
     bool disabled = false;
     SDL_Event e;
     while (!disabled)
 	{
+		Timing::begin_frame();
+		Timing::begin("frame");
+		
+		Timing::begin("events");
 		while (SDL_PollEvent(&e))
 		{
 			// Event-handling code
@@ -2632,8 +7214,10 @@ int main()
                 break;
             }
 		}
-		float now = SDL_GetTicks();
-        delta = (now - then) * 1000 / SDL_GetPerformanceFrequency();
+		Timing::end();
+		
+		Uint64 now = SDL_GetPerformanceCounter();
+        delta = (float) (now - then) / SDL_GetPerformanceFrequency();
         then = now;
    
 		// Drawing
@@ -2644,8 +7228,14 @@ int main()
     	game.update(delta);
     	
 		// Swap buffers
+		Timing::begin("swap");
 		SDL_GL_SwapWindow(window);
+		Timing::end();
+		
+		Timing::end();
+		Timing::end_frame();
 	}
+	Timing::dispose();
 	game.dispose();
 	printf("Modeling exiting");
 	
@@ -1,17 +1,58 @@
 #version 300 es
-precision mediump float;
+precision highp float;
+precision highp int;
 
 in vec3 vColor;
+in vec3 vWorldPosition;
+in vec3 vNormal;
+in float vViewDepth;
 
 out vec4 outColor;
 
 const vec4 fogColor = vec4(0.4, 0.5, 0.9, 1.0);
 const float fogIntensity = 0.001;
 
+uniform vec3 lightPosition;
+
+// Point lights, binned into clusters of the view frustum
+uniform highp usampler2D clusters;
+uniform highp usampler2D lightIndices;
+uniform highp sampler2D lights;
+uniform vec3 clusterCount;
+uniform vec2 tileSize;
+
+// The near plane, and slices per unit of log(depth / near)
+uniform vec2 depthSlicing;
+
+const uint indexRowLength = 1024u;
+
 void main() {
+    vec3 normal = normalize(vNormal);
+    
+    // Diffuse reflection of the fixed light
+    vec3 lightDirection = normalize(lightPosition - vWorldPosition);
+    float intensity = 0.9 * clamp(dot(lightDirection, normal), 0.0, 1.0);
+    vec3 lighting = vec3(intensity + 0.35);
+    
+    ivec3 count = ivec3(clusterCount);
+    ivec2 tile = min(ivec2(gl_FragCoord.xy / tileSize), count.xy - 1);
+    int slice = clamp(int(log(max(vViewDepth, depthSlicing.x) / depthSlicing.x) * depthSlicing.y), 0, count.z - 1);
+    uvec2 cluster = texelFetch(clusters, ivec2(tile.y * count.x + tile.x, slice), 0).xy;
+    for (uint i = cluster.x; i < cluster.x + cluster.y; i++) {
+        int index = int(texelFetch(lightIndices, ivec2(i % indexRowLength, i / indexRowLength), 0).r);
+        vec4 positionRadius = texelFetch(lights, ivec2(0, index), 0);
+        vec3 lightColor = texelFetch(lights, ivec2(1, index), 0).rgb;
+        
+        vec3 toLight = positionRadius.xyz - vWorldPosition;
+        float distance = length(toLight);
+        float falloff = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0);
+        float diffuse = max(dot(toLight / max(distance, 1e-4), normal), 0.0);
+        lighting += lightColor * falloff * falloff * diffuse;
+    }
+    
     float z = (gl_FragCoord.z / gl_FragCoord.w);
     float fog = clamp(exp(-fogIntensity * z * z), 0.2, 1.0);
      
-    vec4 color = vec4(vColor.xyz, 1.0);
+    vec4 color = vec4(vColor * lighting, 1.0);
     outColor = mix(fogColor, color, fog);
 }
\ No newline at end of file
@@ -1,24 +1,33 @@
 #version 300 es
-in vec3 position;
-in vec3 color;
-in vec3 normal;
+layout(location = 0) in vec3 position;
+layout(location = 1) in vec3 color;
+layout(location = 2) in vec3 normal;
 
-out vec3 vColor;
+// Per-object transform and color
+layout(location = 3) in vec3 instancePosition;
+layout(location = 4) in vec3 instanceScaling;
+layout(location = 5) in vec3 instanceColor;
 
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+out vec3 vColor;
+out vec3 vWorldPosition;
+out vec3 vNormal;
+out float vViewDepth;
 
-uniform vec3 lightPosition;
+layout(std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    mat4 overlayProjection;
+};
 		
 void main() {
-    // Diffuse reflection
-    vec3 lightDirection = normalize(lightPosition - position);
-    float dot = dot(lightDirection, normal);
-    float intensity = 0.9 * clamp(dot, 0.0, 1.0);
-     
-    vec3 c = color * (intensity + 0.35);
-    vColor = c;
+    vec3 worldPosition = position * instanceScaling + instancePosition;
+    
+    // The inverse transpose of a scaling is the reciprocal scaling
+    vNormal = normal / instanceScaling;
+    vWorldPosition = worldPosition;
+    vViewDepth = -(vec4(worldPosition, 1.0) * view).z;
+    vColor = color * instanceColor;
     
-    gl_Position = vec4(position.xyz, 1.0) * (model * view * projection);
-}
\ No newline at end of file
+    gl_Position = vec4(worldPosition, 1.0) * viewProjection;
+}
@@ -6,11 +6,16 @@ in vec2 textureCoords;
 out vec3 vColor;
 out vec2 vTextureCoords;
 
-uniform mat4 projection;
+layout(std140) uniform Camera {
+    mat4 view;
+    mat4 projection;
+    mat4 viewProjection;
+    mat4 overlayProjection;
+};
 	
 void main() {
     vColor = color;
     vTextureCoords = textureCoords;
     
-    gl_Position = vec4(position.xyz, 1.0) * projection;
+    gl_Position = vec4(position.xyz, 1.0) * overlayProjection;
 }
\ No newline at end of file